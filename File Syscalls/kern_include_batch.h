@@ -0,0 +1,13 @@
+/*
+ * Declarations for the batched syscall trap.
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <types.h>
+#include <kern/batch.h>
+
+int sys_batch(userptr_t entries, unsigned count, int flags, int *errno);
+
+#endif /* _BATCH_H_ */
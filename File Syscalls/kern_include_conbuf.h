@@ -0,0 +1,22 @@
+/*
+ * Declarations for the shared console output buffer.
+ */
+
+#ifndef _CONBUF_H_
+#define _CONBUF_H_
+
+#include <types.h>
+#include <uio.h>
+#include <vnode.h>
+
+#define CONBUF_SIZE 1024        // Bytes of console output held before a flush
+
+void conbuf_bootstrap(void);
+void conbuf_attach(struct vnode *console);
+int conbuf_is_console(struct vnode *vnode);
+
+int conbuf_write(struct uio *uio);
+int conbuf_write_direct(struct uio *uio);
+int conbuf_flush(void);
+
+#endif /* _CONBUF_H_ */
@@ -25,47 +25,103 @@
 #include <file.h>
 #include <syscall.h>
 #include <copyinout.h>
+#include <vm.h>
 
 #include <proc.h>
 #include <spinlock.h>
 
+struct ioring;
+struct pipe;
+
+/*
+ * Open flag for unbuffered I/O. Block aligned reads and writes move
+ * between the device and the user's pinned pages directly.
+ */
+#ifndef O_DIRECT
+#define O_DIRECT        128
+#endif
+#define DIRECT_IO_ALIGN 512     // One SFS block
+
 ////////////////////////////////////////////////////////
 //              open file table structures            //
 ////////////////////////////////////////////////////////
 
+// Constructed objects kept for reuse instead of going back to kmalloc
+#define OPEN_FILE_CACHE_MAX     64
+#define FD_TABLE_CACHE_MAX      16
+
 // The open file table struct, a doubly linked list
 struct open_file_list {
     struct open_file_node *sentinel;
 };
 
-struct open_file_node {
-    struct open_file_node *prev;
-    struct open_file_node *next;
-
-    struct open_file *open_file;
-};
-
 // Open file details, stored in the node
 struct open_file{
     struct vnode    *vnode;      
+    struct vnode_info *vinfo;   // State shared with other opens of the vnode
+    struct pipe     *pipe;      // Set instead of vnode for a pipe end
 
     // Bookkeeping info.
     off_t           offset;         // #offset in the vnode
     int             flags;
     int             reference_count;
 
-    // Lock
+    // Guards offset; held across I/O only for pipes, devices and appends
     struct lock *mutex;
+
+    struct open_file_node *node;    // The node allocated with this file
+};
+
+// The node and its open file are one allocation
+struct open_file_node {
+    struct open_file_node *prev;
+    struct open_file_node *next;
+
+    struct open_file *open_file;    // Points at file below
+    struct open_file file;
 };
 
 // open file list relate functions
 void open_file_table_create(void);
 void open_file_table_destroy(void);
 struct open_file_node *add_open_file(struct open_file *new);
-void close_open_file(struct open_file_node *node);
+void ref_open_file(struct open_file_node *node);
+int close_open_file(struct open_file_node *node);
 
 // open file entry relate functions
 struct open_file *create_open_file(void);
+void release_open_file(struct open_file *file);
+int open_file_read(struct open_file *file, struct uio *uio);
+int open_file_write(struct open_file *file, struct uio *uio);
+int open_file_io(struct open_file *file, struct uio *uio);
+
+////////////////////////////////////////////////////////
+//                 vnode info structures              //
+////////////////////////////////////////////////////////
+
+// Per vnode state shared by every open file of the vnode, kept in a global list
+struct vnode_info {
+    struct vnode_info *next;
+
+    struct vnode    *vnode;
+    int             reference_count;    // #open files using this entry
+
+    // Attributes cached at first open, so seeks and appends never VOP_STAT
+    int             seekable;
+
+    // Appends find end-of-file and write under this lock, which also guards size
+    struct lock     *append_lock;
+    off_t           size;               // File size including buffered writes
+
+    // Buffers not yet written back, changed under the filebuf lock but read without it
+    volatile unsigned dirty;
+    int             flushing;           // A flush is writing the buffers, filebuf lock
+    int             wb_error;           // First write-back error not yet reported, filebuf lock
+};
+
+void vnode_info_table_create(void);
+struct vnode_info *vnode_info_get(struct vnode *vnode);
+void vnode_info_put(struct vnode_info *vinfo);
 
 ////////////////////////////////////////////////////////
 //         file descriptor table structures           //
@@ -79,14 +135,25 @@ struct file_descriptor_table {
     // struct open_file_node **OF_node_ptr_array;
 
     int next;    // -1 if full
+
+    // Guards the array and next, the table is used by ioring workers too
+    struct lock *lock;
+
+    struct ioring *ioring;  // Async submission ring, NULL until ioring_setup
+
+    int share_count;        // #processes sharing the table copy-on-write
 };
 
 struct file_descriptor_table * FD_table_create(void);
 void FD_table_destroy(struct file_descriptor_table *FD_table);
+struct file_descriptor_table *FD_table_fork(struct file_descriptor_table *FD_table);
+int FD_table_unshare(struct file_descriptor_table **FD_table_ptr);
 int is_fd_table_full(struct file_descriptor_table *FD_table);
 int get_next_fd(struct file_descriptor_table *FD_table);
 struct open_file *get_open_file(struct file_descriptor_table *FD_table, int fd);
-void close_fd(struct file_descriptor_table *FD_table, int fd);
+int close_fd(struct file_descriptor_table *FD_table, int fd);
+int install_fd(struct file_descriptor_table *FD_table, struct open_file_node *node);
+struct open_file_node *acquire_fd(struct file_descriptor_table *FD_table, int fd);
 int validate_fd(struct file_descriptor_table *FD_table, int fd);
 
 ////////////////////////////////////////////////////////
@@ -105,13 +172,28 @@ int validate_fd(struct file_descriptor_table *FD_table, int fd);
  * ssize_t write(int fd, const void *buf, size_t nbytes);
  * off_t lseek(int fd, off_t pos, int whence);
  * int dup2(int oldfd, int newfd);
+ * int fsync(int fd);
+ * int ftruncate(int fd, off_t len);
+ * void sync(void);
+ * ssize_t copy_file_range(int infd, int outfd, size_t len);
+ * int remove(const char *path);
+ * int rename(const char *oldpath, const char *newpath);
  */
 
+// Kernel buffer used by copy_file_range, one frame since frames are allocated singly
+#define COPY_CHUNK_SIZE PAGE_SIZE
+
 int32_t sys_open(userptr_t filename, int flags, mode_t mode, int *errno);
 int32_t sys_close(int fd, int *errno);
 ssize_t sys_read(int fd, userptr_t buf, size_t buflen, int *errno);
 ssize_t sys_write(int fd, userptr_t buf, size_t nbytes, int *errno); 
 uint64_t sys_lseek(int fd, uint64_t pos, int whence, int *errno);
 int sys_dup2(int oldfd, int newfd, int *errno);
+int sys_fsync(int fd, int *errno);
+int sys_ftruncate(int fd, off_t len, int *errno);
+int sys_sync(int *errno);
+ssize_t sys_copy_file_range(int infd, int outfd, size_t len, int *errno);
+int sys_remove(userptr_t pathname, int *errno);
+int sys_rename(userptr_t oldname, userptr_t newname, int *errno);
 
 #endif /* _FILE_H_ */
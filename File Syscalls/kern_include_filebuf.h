@@ -0,0 +1,51 @@
+/*
+ * Declarations for the delayed write-back file buffer cache.
+ */
+
+#ifndef _FILEBUF_H_
+#define _FILEBUF_H_
+
+#include <types.h>
+#include <uio.h>
+#include <vnode.h>
+
+struct vnode_info;
+
+////////////////////////////////////////////////////////
+//                 write-back tunables                //
+////////////////////////////////////////////////////////
+
+#define FILEBUF_BLOCK_SIZE      512     // Bytes per buffer, one SFS block
+#define FILEBUF_MAX_DIRTY       128     // Writers flush everything past this many dirty buffers
+#define FILEBUF_FLUSH_AGE       2       // Seconds a buffer may stay dirty
+#define FILEBUF_FLUSH_INTERVAL  1       // Seconds between flusher passes
+#define FILEBUF_MAX_IOV         16      // Max buffers coalesced into one VOP_WRITE
+
+////////////////////////////////////////////////////////
+//                 dirty buffer structure             //
+////////////////////////////////////////////////////////
+
+// One block of not yet written data, kept on the dirty list oldest first
+struct filebuf {
+    struct filebuf  *prev;
+    struct filebuf  *next;
+
+    struct vnode_info *vinfo;       // The last close writes the buffer back before the info goes
+    off_t           block;          // Block number within the file
+    unsigned        dirty_start;    // Dirty byte range [dirty_start, dirty_end)
+    unsigned        dirty_end;
+    time_t          dirtied;        // Second at which the buffer was first dirtied
+    int             busy;           // A writer is copying into data without filebuf_lock
+
+    char            data[FILEBUF_BLOCK_SIZE];
+};
+
+void filebuf_bootstrap(void);
+void filebuf_shutdown(void);
+
+int filebuf_write(struct vnode_info *vinfo, struct uio *uio);
+int filebuf_flush_vnode(struct vnode_info *vinfo);
+void filebuf_writeback_vnode(struct vnode_info *vinfo);
+int filebuf_flush_all(void);
+
+#endif /* _FILEBUF_H_ */
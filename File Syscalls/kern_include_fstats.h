@@ -0,0 +1,24 @@
+/*
+ * Declarations for the per-CPU file syscall statistics.
+ */
+
+#ifndef _FSTATS_H_
+#define _FSTATS_H_
+
+#include <types.h>
+#include <clock.h>
+#include <kern/fstats.h>
+
+void fstats_bootstrap(void);
+
+void fstats_start(struct timespec *start);
+void fstats_end(int syscall, const struct timespec *start, int err, size_t bytes);
+void fstats_mutex_wait(const struct timespec *start);
+
+void fstats_snapshot(struct fstats *total);
+void fstats_reset(void);
+void fstats_print(void);
+
+int sys_fstats(userptr_t buf, int flags, int *errno);
+
+#endif /* _FSTATS_H_ */
@@ -0,0 +1,57 @@
+/*
+ * Declarations for the asynchronous I/O submission ring.
+ */
+
+#ifndef _IORING_H_
+#define _IORING_H_
+
+#include <types.h>
+#include <synch.h>
+#include <kern/ioring.h>
+
+struct thread;
+struct pipe;
+
+#define IORING_NWORKERS 2       // Worker threads per ring
+
+// Kernel side of a process's ring, hung off its fd table
+struct ioring {
+    userptr_t       shared;     // struct ioring_shared in user memory
+    userptr_t       sq;         // Submission entries in user memory
+    userptr_t       cq;         // Completion entries in user memory
+    uint32_t        entries;
+
+    struct lock     *lock;
+    struct cv       *work_cv;   // Workers wait for submissions
+    struct cv       *done_cv;   // ioring_enter waits for completions
+    struct cv       *space_cv;  // Workers wait for room in the completion ring
+
+    // Entries copied in by ioring_enter, not yet picked up by a worker
+    struct ioring_sqe *queue;
+    uint32_t        queue_head;
+    uint32_t        queue_tail;
+
+    uint32_t        inflight;   // Picked up but not yet completed
+    uint32_t        cq_tail;    // Kernel copy of the completion tail
+
+    uint32_t        dropped;    // Completions that could not be posted
+
+    int             nworkers;   // Workers started
+    int             exiting;
+    struct semaphore *exited;   // Signalled by each worker once it has left the process
+
+    // Each worker and the pipe it may block on, so exit can wake it
+    struct thread   *workers[IORING_NWORKERS];
+    struct pipe     *waiting[IORING_NWORKERS];
+};
+
+struct ioring *ioring_create(userptr_t shared, uint32_t entries);
+void ioring_destroy(struct ioring *ring);
+void ioring_wait_begin(struct pipe *pipe);
+void ioring_wait_end(void);
+int ioring_cancelled(void);
+
+int sys_ioring_setup(userptr_t shared, unsigned entries, int *errno);
+int sys_ioring_enter(unsigned to_submit, unsigned min_complete, int *errno);
+
+#endif /* _IORING_H_ */
@@ -0,0 +1,37 @@
+/*
+ * Layout of the records passed to batch().
+ * Shared between the kernel and userland.
+ */
+
+#ifndef _KERN_BATCH_H_
+#define _KERN_BATCH_H_
+
+/*
+ * batch(entries, count, flags) runs count records in order and returns
+ * how many it ran. Each record names a syscall from kern/syscall.h and
+ * its arguments as 32-bit words in declaration order, with pointers and
+ * ints passed as is. The 64-bit lseek position and ftruncate length
+ * take two words each, high word first:
+ *
+ *    lseek     args[0] fd, args[1] pos high, args[2] pos low, args[3] whence
+ *    ftruncate args[0] fd, args[1] len high, args[2] len low
+ *
+ * Supported: open, close, read, write, lseek, dup2, pipe, fsync,
+ * ftruncate, remove, rename.
+ */
+
+#define BATCH_MAX           64      /* records per call */
+
+/* Flags for batch() */
+#define BATCH_STOP_ON_ERROR 1       /* Stop after the first record that fails */
+
+struct batch_entry {
+        int32_t  sysno;                 /* SYS_* number */
+        uint32_t args[4];
+        int32_t  pad0;
+        int64_t  retval;                /* Filled in by the kernel */
+        int32_t  err;                   /* errno, 0 on success */
+        int32_t  pad1;
+};
+
+#endif /* _KERN_BATCH_H_ */
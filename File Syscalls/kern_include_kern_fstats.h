@@ -0,0 +1,46 @@
+/*
+ * Layout of the file syscall statistics returned by fstats().
+ * Shared between the kernel and userland.
+ */
+
+#ifndef _KERN_FSTATS_H_
+#define _KERN_FSTATS_H_
+
+/* Instrumented syscalls, indices into fstats.sys */
+#define FSTATS_OPEN         0
+#define FSTATS_READ         1
+#define FSTATS_WRITE        2
+#define FSTATS_LSEEK        3
+#define FSTATS_DUP2         4
+#define FSTATS_CLOSE        5
+#define FSTATS_NSYSCALLS    6
+
+#define FSTATS_NERRNO       64      /* errno values past this are counted in the last slot */
+
+/*
+ * Latency histogram buckets, in nanoseconds:
+ *
+ *    latency[0]    below 1024
+ *    latency[i]    [2^(9+i), 2^(10+i))
+ *    latency[last] everything from 2^(9+FSTATS_NBUCKETS-1) up
+ */
+#define FSTATS_NBUCKETS     20
+
+struct fstats_syscall {
+        uint64_t calls;
+        uint64_t bytes;                         /* Transferred by read/write */
+        uint64_t total_ns;                      /* Sum of all latencies */
+        uint32_t errors[FSTATS_NERRNO];         /* Failed calls by errno */
+        uint32_t latency[FSTATS_NBUCKETS];
+};
+
+struct fstats {
+        struct fstats_syscall sys[FSTATS_NSYSCALLS];
+        uint64_t mutex_acquires;                /* Acquires of open_file->mutex */
+        uint64_t mutex_wait_ns;                 /* Time spent acquiring it */
+};
+
+/* Flags for fstats() */
+#define FSTATS_RESET        1       /* Zero the counters after reading them */
+
+#endif /* _KERN_FSTATS_H_ */
@@ -0,0 +1,60 @@
+/*
+ * Layout of the asynchronous I/O submission and completion rings.
+ * Shared between the kernel and userland.
+ */
+
+#ifndef _KERN_IORING_H_
+#define _KERN_IORING_H_
+
+/*
+ * The rings live in user memory registered with ioring_setup():
+ *
+ *    struct ioring_shared    header
+ *    struct ioring_sqe       sq[entries]
+ *    struct ioring_cqe       cq[entries]
+ *
+ * The user fills sq[sq_tail % entries] and advances sq_tail, then calls
+ * ioring_enter() which consumes entries up to sq_tail and advances
+ * sq_head. The kernel posts results at cq[cq_tail % entries] and
+ * advances cq_tail; the user reaps them and advances cq_head. Heads and
+ * tails only ever increase and wrap at 2^32. Completions that could not
+ * be posted, say to a bad buffer, are counted in cq_dropped.
+ */
+
+#define IORING_MAX_ENTRIES  256     /* entries must be a power of two up to this */
+
+/* Operations */
+#define IORING_OP_NOP       0
+#define IORING_OP_READ      1
+#define IORING_OP_WRITE     2
+#define IORING_OP_LSEEK     3
+#define IORING_OP_CLOSE     4
+
+struct ioring_shared {
+        volatile uint32_t sq_head;      /* Advanced by the kernel */
+        volatile uint32_t sq_tail;      /* Advanced by the user */
+        volatile uint32_t cq_head;      /* Advanced by the user */
+        volatile uint32_t cq_tail;      /* Advanced by the kernel */
+        uint32_t entries;
+        volatile uint32_t cq_dropped;   /* Completions the kernel could not post */
+};
+
+/* Submission entry */
+struct ioring_sqe {
+        uint32_t opcode;                /* IORING_OP_* */
+        int32_t fd;
+        int64_t pos;                    /* lseek position */
+        int32_t whence;                 /* lseek whence */
+        uint32_t len;                   /* read/write length */
+        uint32_t buf;                   /* read/write user buffer */
+        uint32_t user_data;             /* Copied to the completion */
+};
+
+/* Completion entry */
+struct ioring_cqe {
+        uint32_t user_data;
+        int32_t err;                    /* errno, 0 on success */
+        int64_t res;                    /* Return value of the operation */
+};
+
+#endif /* _KERN_IORING_H_ */
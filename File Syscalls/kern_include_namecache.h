@@ -0,0 +1,32 @@
+/*
+ * Declarations for the pathname lookup cache.
+ */
+
+#ifndef _NAMECACHE_H_
+#define _NAMECACHE_H_
+
+#include <types.h>
+#include <vnode.h>
+
+#define NAMECACHE_BUCKETS   64      // Hash buckets, a power of two
+#define NAMECACHE_MAX       128     // Entries kept before the least recently used is evicted
+#define NAMECACHE_NAMELEN   32      // Longer components are looked up but not cached
+
+// Maps (directory vnode, component) to the child vnode, or to NULL if it does not exist
+struct namecache_entry {
+    struct namecache_entry *hash_next;
+    struct namecache_entry *lru_prev;   // Most recently used first
+    struct namecache_entry *lru_next;
+
+    struct vnode    *dir;               // Referenced while cached
+    struct vnode    *child;             // Referenced while cached, NULL for a negative entry
+    char            name[NAMECACHE_NAMELEN + 1];
+};
+
+void namecache_bootstrap(void);
+
+int namecache_open(char *path, int openflags, mode_t mode, struct vnode **ret);
+int namecache_lookparent(char *path, struct vnode **ret, char *buf, size_t buflen);
+void namecache_invalidate(struct vnode *dir, const char *name);
+
+#endif /* _NAMECACHE_H_ */
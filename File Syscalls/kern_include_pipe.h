@@ -0,0 +1,48 @@
+/*
+ * Declarations for in-kernel pipes.
+ */
+
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+#include <types.h>
+#include <uio.h>
+#include <synch.h>
+#include <vm.h>
+
+#define PIPE_NPAGES     4       // Pages of data a pipe holds before writers block
+
+// One page of pipe data, bytes [start, end) are unread
+struct pipe_page {
+    vaddr_t         kva;
+    unsigned        start;
+    unsigned        end;
+};
+
+struct pipe {
+    struct lock     *lock;          // Guards everything below
+    struct cv       *readable;      // Signalled when data arrives or the write end closes
+    struct cv       *writable;      // Signalled when a page frees up or the read end closes
+
+    // Ring of filled pages, oldest first
+    struct pipe_page ring[PIPE_NPAGES];
+    unsigned        head;
+    unsigned        npages;
+
+    // Empty pages kept for reuse
+    vaddr_t         spare[PIPE_NPAGES];
+    unsigned        nspare;
+
+    int             read_open;      // 1 while the read end is open
+    int             write_open;     // 1 while the write end is open
+};
+
+struct pipe *pipe_create(void);
+int pipe_read(struct pipe *pipe, struct uio *uio);
+int pipe_write(struct pipe *pipe, struct uio *uio);
+void pipe_wake(struct pipe *pipe);
+void pipe_close(struct pipe *pipe, int write_end);
+
+int sys_pipe(userptr_t fds, int *errno);
+
+#endif /* _PIPE_H_ */
@@ -0,0 +1,118 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/syscall.h>
+#include <kern/batch.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <file.h>
+#include <pipe.h>
+#include <batch.h>
+
+/*
+ * Batched syscalls.
+ *
+ * A program that issues many short file syscalls in a row, like a shell
+ * rewiring descriptors before exec, can hand them all to batch() and
+ * pay for one trap. Records run in order through the normal sys_*
+ * implementations, so each behaves exactly as if called on its own.
+ */
+
+// Run one record and store its result in it
+static void run_entry(struct batch_entry *entry) {
+    uint32_t *a = entry->args;
+    int err = 0;
+    int64_t ret;
+
+    switch (entry->sysno) {
+        case SYS_open:
+            ret = sys_open((userptr_t)a[0], a[1], a[2], &err);
+            break;
+        case SYS_close:
+            ret = sys_close(a[0], &err);
+            break;
+        case SYS_read:
+            ret = sys_read(a[0], (userptr_t)a[1], a[2], &err);
+            break;
+        case SYS_write:
+            ret = sys_write(a[0], (userptr_t)a[1], a[2], &err);
+            break;
+        case SYS_lseek: {
+            uint64_t pos = ((uint64_t)a[1] << 32) | a[2];
+            uint64_t newpos = sys_lseek(a[0], pos, a[3], &err);
+            ret = newpos == (uint64_t)-1 ? -1 : (int64_t)newpos;
+            break;
+        }
+        case SYS_dup2:
+            ret = sys_dup2(a[0], a[1], &err);
+            break;
+        case SYS_pipe:
+            ret = sys_pipe((userptr_t)a[0], &err);
+            break;
+        case SYS_fsync:
+            ret = sys_fsync(a[0], &err);
+            break;
+        case SYS_ftruncate: {
+            off_t len = (off_t)(((uint64_t)a[1] << 32) | a[2]);
+            ret = sys_ftruncate(a[0], len, &err);
+            break;
+        }
+        case SYS_remove:
+            ret = sys_remove((userptr_t)a[0], &err);
+            break;
+        case SYS_rename:
+            ret = sys_rename((userptr_t)a[0], (userptr_t)a[1], &err);
+            break;
+        default:
+            ret = -1;
+            err = ENOSYS;
+            break;
+    }
+
+    // Syscalls leave errno alone on success
+    entry->retval = ret;
+    entry->err = ret == -1 ? err : 0;
+}
+
+/* Run count records from entries in order, writing each one's result
+ * back. Return the number of records run, which is short of count only
+ * with BATCH_STOP_ON_ERROR.
+ */
+int sys_batch(userptr_t entries, unsigned count, int flags, int *errno) {
+    if (count > BATCH_MAX || (flags & ~BATCH_STOP_ON_ERROR) != 0) {
+        *errno = EINVAL;
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    size_t size = count * sizeof(struct batch_entry);
+    struct batch_entry *batch = kmalloc(size);
+    if (batch == NULL) {
+        *errno = ENOMEM;
+        return -1;
+    }
+
+    *errno = copyin(entries, batch, size);
+    if (*errno) {
+        kfree(batch);
+        return -1;
+    }
+
+    unsigned ran = 0;
+    while (ran < count) {
+        run_entry(&batch[ran]);
+        ran++;
+
+        if (batch[ran - 1].err != 0 && (flags & BATCH_STOP_ON_ERROR)) break;
+    }
+
+    // Only records that ran are written back
+    *errno = copyout(batch, entries, ran * sizeof(struct batch_entry));
+    kfree(batch);
+    if (*errno) {
+        return -1;
+    }
+
+    return ran;
+}
@@ -0,0 +1,123 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <vnode.h>
+#include <conbuf.h>
+
+/*
+ * Line buffered console output.
+ *
+ * Every write to the console vnode lands in one kernel-wide buffer that
+ * is written to the device when a newline arrives, when it fills up,
+ * before anything reads from the console, when a process exits, and
+ * once per filebuf flusher pass so prompts without a newline still
+ * show up. Console open files with O_DIRECT, stderr's among them, push
+ * the buffer out and write straight to the device.
+ */
+
+static struct vnode *console_vnode = NULL;
+static struct lock *conbuf_lock = NULL;
+static char conbuf[CONBUF_SIZE];
+static size_t conbuf_len = 0;
+
+void conbuf_bootstrap() {
+    conbuf_lock = lock_create("conbuf_lock");
+    if (conbuf_lock == NULL) {
+        panic("Insufficient memory for console buffer\n");
+    }
+}
+
+// Route writes to this vnode through the buffer
+void conbuf_attach(struct vnode *console) {
+    lock_acquire(conbuf_lock);
+    console_vnode = console;
+    lock_release(conbuf_lock);
+}
+
+// Check if the vnode is the buffered console, 1 if it is
+int conbuf_is_console(struct vnode *vnode) {
+    return vnode != NULL && vnode == console_vnode;
+}
+
+// Write the buffer to the device, caller holds conbuf_lock
+static int flush_locked(void) {
+    if (conbuf_len == 0) return 0;
+
+    struct iovec iov;
+    struct uio uio;
+    uio_kinit(&iov, &uio, conbuf, conbuf_len, 0, UIO_WRITE);
+    int result = VOP_WRITE(console_vnode, &uio);
+
+    // Console output that fails is not retried
+    conbuf_len = 0;
+    return result;
+}
+
+// Write uio to the device after what is buffered, caller holds conbuf_lock
+static int write_through_locked(struct uio *uio) {
+    int result = flush_locked();
+    if (result) return result;
+
+    return VOP_WRITE(console_vnode, uio);
+}
+
+/* Buffer the data described by uio and advance it as VOP_WRITE would.
+ * Writes too big for the buffer go straight to the device.
+ */
+int conbuf_write(struct uio *uio) {
+    int result = 0;
+
+    lock_acquire(conbuf_lock);
+
+    if (uio->uio_resid > CONBUF_SIZE) {
+        result = write_through_locked(uio);
+        lock_release(conbuf_lock);
+        return result;
+    }
+
+    while (uio->uio_resid > 0) {
+        if (conbuf_len == CONBUF_SIZE && (result = flush_locked()) != 0) break;
+
+        size_t len = CONBUF_SIZE - conbuf_len;
+        if (len > uio->uio_resid) len = uio->uio_resid;
+
+        size_t start = conbuf_len;
+        if ((result = uiomove(conbuf + start, len, uio)) != 0) break;
+        conbuf_len += len;
+
+        // Line buffered: a newline pushes everything out
+        for (size_t i = start; i < conbuf_len; i++) {
+            if (conbuf[i] == '\n') {
+                result = flush_locked();
+                break;
+            }
+        }
+        if (result) break;
+    }
+
+    lock_release(conbuf_lock);
+
+    return result;
+}
+
+// Write uio to the device at once, keeping it after earlier buffered output
+int conbuf_write_direct(struct uio *uio) {
+    lock_acquire(conbuf_lock);
+    int result = write_through_locked(uio);
+    lock_release(conbuf_lock);
+
+    return result;
+}
+
+// Write any buffered console output to the device
+int conbuf_flush() {
+    if (console_vnode == NULL) return 0;
+
+    lock_acquire(conbuf_lock);
+    int result = flush_locked();
+    lock_release(conbuf_lock);
+
+    return result;
+}
@@ -17,6 +17,13 @@
 
 #include <proc.h>
 #include <spinlock.h>
+#include <filebuf.h>
+#include <ioring.h>
+#include <conbuf.h>
+#include <namecache.h>
+#include <fstats.h>
+#include <pipe.h>
+#include <addrspace.h>
 
 // NOTE:
 ////////////////////////////////////////////////////////
@@ -25,6 +32,21 @@
 
 struct open_file_list *open_file_table = NULL;
 
+// Guards the list links and every open file's reference_count
+static struct lock *open_file_table_lock = NULL;
+
+// Constructed open files and fd tables kept for reuse, their locks already created
+static struct open_file_node *open_file_cache[OPEN_FILE_CACHE_MAX];
+static int open_file_cache_count = 0;
+static struct file_descriptor_table *FD_table_cache[FD_TABLE_CACHE_MAX];
+static int FD_table_cache_count = 0;
+static struct lock *object_cache_lock = NULL;
+
+// The console open files every process's stdout and stderr share, stderr's is unbuffered
+static struct open_file_node *console_node = NULL;
+static struct open_file_node *console_err_node = NULL;
+static struct lock *console_lock = NULL;
+
 // Initialize the global open file table
 void open_file_table_create() {
     open_file_table = kmalloc(sizeof(struct open_file_list));
@@ -40,16 +62,46 @@ void open_file_table_create() {
     open_file_table->sentinel->prev = open_file_table->sentinel;
     open_file_table->sentinel->next = open_file_table->sentinel;
     open_file_table->sentinel->open_file = NULL;
+
+    if ((open_file_table_lock = lock_create("open_file_table_lock")) == NULL) {
+        panic("Insufficient memory for open file table\n");
+    }
+    if ((console_lock = lock_create("console_lock")) == NULL) {
+        panic("Insufficient memory for open file table\n");
+    }
+    if ((object_cache_lock = lock_create("object_cache_lock")) == NULL) {
+        panic("Insufficient memory for open file table\n");
+    }
+
+    vnode_info_table_create();
+    namecache_bootstrap();
+    conbuf_bootstrap();
+    filebuf_bootstrap();
 }
 
-static void free_open_file_node(struct open_file_node *node) {
+/* Write back any buffered data before the vnode is released,
+ * return the write-back error if any */
+static int free_open_file_node(struct open_file_node *node) {
+    // A pipe end has no vnode, just its side of the pipe
+    if (node->open_file->pipe != NULL) {
+        pipe_close(node->open_file->pipe, (node->open_file->flags & O_ACCMODE) == O_WRONLY);
+        release_open_file(node->open_file);
+        return 0;
+    }
+
+    int result = filebuf_flush_vnode(node->open_file->vinfo);
+    vnode_info_put(node->open_file->vinfo);
     vfs_close(node->open_file->vnode);
-    lock_destroy(node->open_file->mutex);
-    kfree(node);
+    release_open_file(node->open_file);
+
+    return result;
 }
 
 // Destroy the global open file table to prevent memory leak
 void open_file_table_destroy() {
+    filebuf_shutdown();
+    conbuf_flush();
+
     // Free all the nodes
     struct open_file_node *sentinel = open_file_table->sentinel;
     struct open_file_node *curr;
@@ -61,21 +113,63 @@ void open_file_table_destroy() {
 
     kfree(sentinel);
     kfree(open_file_table);
+    lock_destroy(open_file_table_lock);
+    lock_destroy(console_lock);
+    console_node = NULL;
+    console_err_node = NULL;
+
+    // Empty the object caches
+    while (open_file_cache_count > 0) {
+        struct open_file_node *node = open_file_cache[--open_file_cache_count];
+        lock_destroy(node->open_file->mutex);
+        kfree(node);
+    }
+    while (FD_table_cache_count > 0) {
+        struct file_descriptor_table *FD_table = FD_table_cache[--FD_table_cache_count];
+        lock_destroy(FD_table->lock);
+        kfree(FD_table);
+    }
+    lock_destroy(object_cache_lock);
+}
+
+/* Return the kernel-wide console open file at *nodep, opening it with
+ * flags on first use. The table keeps one reference of its own so it is
+ * never closed while the system runs.
+ */
+static struct open_file_node *get_console_node(struct open_file_node **nodep, int flags) {
+    lock_acquire(console_lock);
+    if (*nodep != NULL) {
+        lock_release(console_lock);
+        return *nodep;
+    }
+
+    char console_path[] = "con:";
+    struct open_file *console = create_open_file();
+    if (console == NULL) {
+        panic("Insufficient memory for console open file\n");
+    }
+    if (vfs_open(console_path, O_WRONLY, 0, &console->vnode) != 0) {
+        panic("console opened failed\n");
+    }
+    if ((console->vinfo = vnode_info_get(console->vnode)) == NULL) {
+        panic("Insufficient memory for console open file\n");
+    }
+    console->flags = flags;
+
+    *nodep = add_open_file(console);
+    conbuf_attach(console->vnode);
+
+    lock_release(console_lock);
+    return *nodep;
 }
 
 /* Insert a new open file to the end of the open file list, 
 and return the address of the node */
 struct open_file_node *add_open_file(struct open_file *new) {
-    // Malloc a new node
-    struct open_file_node *new_node = kmalloc(sizeof(struct open_file_node));
-    if (new_node == NULL) {
-        kprintf("Insufficient memory for open file node\n");
-        vfs_close(new->vnode);
-        lock_destroy(new->mutex);
-        return NULL;
-    }
+    // The node came with the open file
+    struct open_file_node *new_node = new->node;
 
-    new_node->open_file = new;
+    lock_acquire(open_file_table_lock);
     struct open_file_node *sentinel = open_file_table->sentinel;
     
     // Add into the linked list
@@ -83,88 +177,518 @@ struct open_file_node *add_open_file(struct open_file *new) {
     new_node->prev = sentinel->prev;
     sentinel->prev = new_node;
     new_node->prev->next = new_node;
+    lock_release(open_file_table_lock);
 
     return new_node;
 }
 
-// Decrement reference count of the open file that the node contains
-void close_open_file(struct open_file_node *node) {
+// Take another reference to the open file that the node contains
+void ref_open_file(struct open_file_node *node) {
+    lock_acquire(open_file_table_lock);
+    node->open_file->reference_count++;
+    lock_release(open_file_table_lock);
+}
+
+/* Decrement reference count of the open file that the node contains,
+ * return the write-back error if this was the last reference */
+int close_open_file(struct open_file_node *node) {
+    lock_acquire(open_file_table_lock);
+
     // Decrement the reference count
     node->open_file->reference_count--;
 
     // If no reference, remove the node
-    if (node->open_file->reference_count == 0) {
+    int last = node->open_file->reference_count == 0;
+    if (last) {
         node->prev->next = node->next;
         node->next->prev = node->prev;
-        free_open_file_node(node);
     }
+
+    lock_release(open_file_table_lock);
+
+    // Nobody else can reach the node now, free it without the lock
+    if (last) {
+        return free_open_file_node(node);
+    }
+
+    return 0;
 }
 
-// Create a new open file
+/* Create a new open file together with its node, taking a constructed
+ * one from the cache if possible. NULL if out of memory.
+ */
 struct open_file *create_open_file() {
-    struct open_file *new = kmalloc(sizeof(struct open_file));
-    if (new == NULL) {
-        kprintf("Insufficient memory for new open file");
-        return NULL;
+    struct open_file_node *node = NULL;
+
+    lock_acquire(object_cache_lock);
+    if (open_file_cache_count > 0) {
+        node = open_file_cache[--open_file_cache_count];
     }
+    lock_release(object_cache_lock);
 
+    if (node == NULL) {
+        node = kmalloc(sizeof(struct open_file_node));
+        if (node == NULL) {
+            kprintf("Insufficient memory for new open file");
+            return NULL;
+        }
+        node->open_file = &node->file;
+        node->file.node = node;
+        if ((node->file.mutex = lock_create("mutex")) == NULL) {
+            kfree(node);
+            return NULL;
+        }
+    }
+
+    struct open_file *new = node->open_file;
     new->vnode = NULL;
+    new->vinfo = NULL;
+    new->pipe = NULL;
     new->offset = 0;
     new->flags = 0;
     new->reference_count = 1;
-    new->mutex = lock_create("mutex");
 
     return new;
 }
 
+/* Give back an open file that is unlinked and holds no vnode or pipe.
+ * Its node and lock are kept for the next create_open_file.
+ */
+void release_open_file(struct open_file *file) {
+    struct open_file_node *node = file->node;
+
+    lock_acquire(object_cache_lock);
+    if (open_file_cache_count < OPEN_FILE_CACHE_MAX) {
+        open_file_cache[open_file_cache_count++] = node;
+        node = NULL;
+    }
+    lock_release(object_cache_lock);
+
+    // The cache is full
+    if (node != NULL) {
+        lock_destroy(file->mutex);
+        kfree(node);
+    }
+}
+
 // NOTE:
 ////////////////////////////////////////////////////////
-//          file descriptor table functions           //
+//               open file I/O functions              //
 ////////////////////////////////////////////////////////
 
-struct file_descriptor_table *FD_table_create() {
-    struct file_descriptor_table *FD_table = kmalloc(sizeof(struct file_descriptor_table));
-    if (FD_table == NULL) {
-        kprintf("Insufficient memory for file descriptor table");
-        return NULL;
+// Acquire the open file's mutex, recording how long it took
+static void open_file_lock(struct open_file *file) {
+    struct timespec start;
+    fstats_start(&start);
+    lock_acquire(file->mutex);
+    fstats_mutex_wait(&start);
+}
+
+// Read from the vnode at uio's offset
+static int vnode_read(struct open_file *file, struct uio *uio) {
+    /* Reads go to the vnode, so pending writes have to land first. The
+     * dirty count is checked without the filebuf lock, so reads of files
+     * nobody is writing never take it */
+    if (conbuf_is_console(file->vnode)) {
+        conbuf_flush();
+    } else if (file->vinfo->seekable && file->vinfo->dirty != 0) {
+        filebuf_writeback_vnode(file->vinfo);
     }
 
-    for (int i = 0; i < __OPEN_MAX; i++) {
-        FD_table->OF_node_ptr_array[i] = NULL;
+    return VOP_READ(file->vnode, uio);
+}
+
+/* Record that the file now reaches end. The size only shrinks under
+ * the append lock, so a write inside the file, the common case, just
+ * compares and leaves the lock alone. locked is set if the caller
+ * holds the append lock.
+ */
+static void vinfo_grow(struct vnode_info *vinfo, off_t end, int locked) {
+    if (end <= vinfo->size) return;
+
+    if (!locked) {
+        lock_acquire(vinfo->append_lock);
     }
+    if (end > vinfo->size) {
+        vinfo->size = end;
+    }
+    if (!locked) {
+        lock_release(vinfo->append_lock);
+    }
+}
 
-    // Connect 1 to stdout, 2 to stderr.
-    char stdout_path[] = "con:";
-    struct open_file *stdout = create_open_file();
-    int errno = vfs_open(stdout_path, O_WRONLY, 0, &stdout->vnode);
-    if (errno != 0) {
-        panic("stdout opened failed\n");
-        return NULL;
+/* Write to the vnode at uio's offset and record growth of the file.
+ * append is set if the caller holds the vnode's append lock.
+ */
+static int vnode_write(struct open_file *file, struct uio *uio, int append) {
+    // Regular files are written back later, console output is line
+    // buffered unless opened O_DIRECT, other devices are written directly
+    int result;
+    if (conbuf_is_console(file->vnode)) {
+        result = (file->flags & O_DIRECT) ? conbuf_write_direct(uio) : conbuf_write(uio);
+    } else if (file->vinfo->seekable) {
+        result = filebuf_write(file->vinfo, uio);
+    } else {
+        result = VOP_WRITE(file->vnode, uio);
+    }
+
+    // Record growth of the file, buffered or not
+    vinfo_grow(file->vinfo, uio->uio_offset, append);
+
+    return result;
+}
+
+/* Read into uio from the file's offset and advance the offset.
+ * Caller holds file->mutex.
+ */
+int open_file_read(struct open_file *file, struct uio *uio) {
+    // Pipes have no offset
+    if (file->pipe != NULL) {
+        return pipe_read(file->pipe, uio);
+    }
+
+    uio->uio_offset = file->offset;
+    int result = vnode_read(file, uio);
+    if (result) return result;
+
+    // Update the offset to the open file
+    file->offset = uio->uio_offset;
+
+    return 0;
+}
+
+/* Write uio at the file's offset, or at end-of-file for O_APPEND, and
+ * advance the offset. Caller holds file->mutex.
+ */
+int open_file_write(struct open_file *file, struct uio *uio) {
+    // Pipes have no offset or size, O_APPEND means nothing to them
+    if (file->pipe != NULL) {
+        return pipe_write(file->pipe, uio);
+    }
+
+    /* Appends hold the append lock across finding end-of-file and the
+     * write itself, so appenders through different open files never
+     * overwrite each other */
+    struct vnode_info *vinfo = file->vinfo;
+    int append = (file->flags & O_APPEND) == O_APPEND;
+    if (append) {
+        lock_acquire(vinfo->append_lock);
+        file->offset = vinfo->size;
+    }
+
+    uio->uio_offset = file->offset;
+    int result = vnode_write(file, uio, append);
+
+    if (append) {
+        lock_release(vinfo->append_lock);
+    }
+
+    if (result) return result;
+
+    // Update the offset to the open file
+    file->offset = uio->uio_offset;
+
+    return 0;
+}
+
+/* Check if uio can move straight between the device and the user's
+ * pages, 1 if so: O_DIRECT, a single user buffer, and the file offset,
+ * length and buffer address all block aligned.
+ */
+static int is_direct(struct open_file *file, struct uio *uio, off_t pos) {
+    if ((file->flags & O_DIRECT) == 0) return 0;
+    if (uio->uio_segflg != UIO_USERSPACE || uio->uio_iovcnt != 1) return 0;
+
+    vaddr_t buf = (vaddr_t)uio->uio_iov->iov_ubase;
+    return pos % DIRECT_IO_ALIGN == 0 && uio->uio_resid % DIRECT_IO_ALIGN == 0 && buf % DIRECT_IO_ALIGN == 0;
+}
+
+/* Transfer uio at its offset between the vnode and the user's frames,
+ * which stay pinned for the duration, with no buffer in between.
+ * Advances uio's offset and resid like VOP_READ/VOP_WRITE.
+ */
+static int direct_io(struct open_file *file, struct uio *uio) {
+    vaddr_t buf = (vaddr_t)uio->uio_iov->iov_ubase;
+    size_t len = uio->uio_resid;
+    if (len == 0) return 0;
+
+    unsigned npages = (buf + len - 1) / PAGE_SIZE - buf / PAGE_SIZE + 1;
+    vaddr_t *frames = kmalloc(npages * sizeof(vaddr_t));
+    struct iovec *iov = kmalloc(npages * sizeof(struct iovec));
+    if (frames == NULL || iov == NULL) {
+        if (frames != NULL) kfree(frames);
+        if (iov != NULL) kfree(iov);
+        return ENOMEM;
+    }
+
+    // Buffered blocks in the range would shadow a read or overwrite a write later
+    if (file->vinfo->dirty != 0) {
+        filebuf_writeback_vnode(file->vinfo);
+    }
+
+    // Reading from the file stores into the user's pages
+    struct addrspace *as = proc_getas();
+    int result = as_pin_pages(as, buf, len, uio->uio_rw == UIO_READ, frames);
+
+    if (result == 0) {
+        // One iovec per page, reaching the frames through kseg0
+        size_t left = len;
+        size_t first = buf % PAGE_SIZE;
+        for (unsigned i = 0; i < npages; i++) {
+            size_t skip = i == 0 ? first : 0;
+            iov[i].iov_kbase = (void *)(frames[i] + skip);
+            iov[i].iov_len = left < PAGE_SIZE - skip ? left : PAGE_SIZE - skip;
+            left -= iov[i].iov_len;
+        }
+
+        struct uio kuio;
+        kuio.uio_iov = iov;
+        kuio.uio_iovcnt = npages;
+        kuio.uio_offset = uio->uio_offset;
+        kuio.uio_resid = len;
+        kuio.uio_segflg = UIO_SYSSPACE;
+        kuio.uio_rw = uio->uio_rw;
+        kuio.uio_space = NULL;
+
+        if (uio->uio_rw == UIO_READ) {
+            result = VOP_READ(file->vnode, &kuio);
+        } else {
+            result = VOP_WRITE(file->vnode, &kuio);
+        }
+        as_unpin_pages(as, buf, len);
+
+        uio->uio_offset = kuio.uio_offset;
+        uio->uio_resid = kuio.uio_resid;
+
+        // Record growth of the file
+        if (uio->uio_rw == UIO_WRITE) {
+            vinfo_grow(file->vinfo, uio->uio_offset, 0);
+        }
     }
 
-    struct open_file_node *new_node = NULL;
-    if ((new_node = add_open_file(stdout)) == NULL) {
-        panic("Insufficient memory for stdio initialization in fd table");
+    kfree(frames);
+    kfree(iov);
+
+    return result;
+}
+
+/* Check if I/O on the file can run outside its mutex, 1 if so.
+ * Only positioned vnode I/O can: pipes rely on the mutex to keep one
+ * reader and one writer, appends on it to find end-of-file, and the
+ * offset means nothing to devices.
+ */
+static int can_reserve(struct open_file *file, enum uio_rw rw) {
+    if (file->pipe != NULL) return 0;
+    if (conbuf_is_console(file->vnode) || !file->vinfo->seekable) return 0;
+    if (rw == UIO_WRITE && (file->flags & O_APPEND) == O_APPEND) return 0;
+    return 1;
+}
+
+/* Read or write uio through the file, advancing its offset.
+ *
+ * For regular files the byte range is reserved by moving the offset past
+ * it under the mutex, then the I/O runs without the mutex so threads
+ * sharing the open file proceed in parallel. A short or failed transfer
+ * gives back the unused part of the range, unless another thread has
+ * moved the offset since.
+ */
+int open_file_io(struct open_file *file, struct uio *uio) {
+    int result;
+
+    if (!can_reserve(file, uio->uio_rw)) {
+        open_file_lock(file);
+        if (uio->uio_rw == UIO_READ) {
+            result = open_file_read(file, uio);
+        } else {
+            result = open_file_write(file, uio);
+        }
+        lock_release(file->mutex);
+        return result;
+    }
+
+    // Reserve [pos, pos + len)
+    size_t len = uio->uio_resid;
+    open_file_lock(file);
+    off_t pos = file->offset;
+    file->offset = pos + len;
+    lock_release(file->mutex);
+
+    uio->uio_offset = pos;
+    if (is_direct(file, uio, pos)) {
+        result = direct_io(file, uio);
+    } else if (uio->uio_rw == UIO_READ) {
+        result = vnode_read(file, uio);
     } else {
-	    FD_table->OF_node_ptr_array[1] = new_node;
-        FD_table->OF_node_ptr_array[1]->open_file->flags = O_WRONLY;
+        result = vnode_write(file, uio, 0);
+    }
+
+    // Give back what was not transferred, a failed call moves nothing
+    if (result || uio->uio_resid != 0) {
+        off_t end = result ? pos : uio->uio_offset;
+        open_file_lock(file);
+        if (file->offset == pos + (off_t)len) {
+            file->offset = end;
+        }
+        lock_release(file->mutex);
+    }
+
+    return result;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 vnode info functions               //
+////////////////////////////////////////////////////////
+
+static struct vnode_info *vnode_info_list = NULL;
+static struct lock *vnode_info_lock = NULL;
+
+void vnode_info_table_create() {
+    vnode_info_lock = lock_create("vnode_info_lock");
+    if (vnode_info_lock == NULL) {
+        panic("Insufficient memory for vnode info table\n");
+    }
+}
+
+/* Return the shared info of the vnode, creating it on the first open.
+ * NULL if out of memory.
+ */
+struct vnode_info *vnode_info_get(struct vnode *vnode) {
+    lock_acquire(vnode_info_lock);
+
+    struct vnode_info *curr;
+    for (curr = vnode_info_list; curr != NULL; curr = curr->next) {
+        if (curr->vnode == vnode) {
+            curr->reference_count++;
+            lock_release(vnode_info_lock);
+            return curr;
+        }
     }
 
-    char stderr_path[] = "con:";
-    struct open_file *stderr = create_open_file();
-    errno = vfs_open(stderr_path, O_WRONLY, 0, &stderr->vnode);
-    if (errno != 0) {
-        panic("stderr opened failed\n");
+    struct vnode_info *new = kmalloc(sizeof(struct vnode_info));
+    if (new == NULL) {
+        lock_release(vnode_info_lock);
         return NULL;
     }
-    
-    if ((new_node = add_open_file(stderr)) == NULL) {
-        panic("Insufficient memory for stdio initialization in fd table");
-    } else {
-	    FD_table->OF_node_ptr_array[2] = new_node;
-        FD_table->OF_node_ptr_array[2]->open_file->flags = O_WRONLY;
+    if ((new->append_lock = lock_create("append_lock")) == NULL) {
+        kfree(new);
+        lock_release(vnode_info_lock);
+        return NULL;
+    }
+
+    /* Nobody else has the vnode open, so no buffered data is pending
+     * and this is the only time the attributes come from the file system.
+     * Writes and truncates keep the size current from here on */
+    struct stat stat;
+    new->size = 0;
+    new->dirty = 0;
+    new->flushing = 0;
+    new->wb_error = 0;
+    new->seekable = VOP_ISSEEKABLE(vnode);
+    if (new->seekable && VOP_STAT(vnode, &stat) == 0) {
+        new->size = stat.st_size;
+    }
+
+    new->vnode = vnode;
+    new->reference_count = 1;
+    new->next = vnode_info_list;
+    vnode_info_list = new;
+
+    lock_release(vnode_info_lock);
+    return new;
+}
+
+// Drop a reference, freeing the info once the last open file is gone
+void vnode_info_put(struct vnode_info *vinfo) {
+    lock_acquire(vnode_info_lock);
+
+    vinfo->reference_count--;
+    if (vinfo->reference_count > 0) {
+        lock_release(vnode_info_lock);
+        return;
+    }
+
+    // Unlink from the list
+    struct vnode_info **curr = &vnode_info_list;
+    while (*curr != vinfo) {
+        curr = &(*curr)->next;
+    }
+    *curr = vinfo->next;
+
+    lock_release(vnode_info_lock);
+
+    lock_destroy(vinfo->append_lock);
+    kfree(vinfo);
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//          file descriptor table functions           //
+////////////////////////////////////////////////////////
+
+/* Return an unshared table without an ioring, taking a constructed one
+ * from the cache if possible. NULL if out of memory.
+ */
+static struct file_descriptor_table *alloc_FD_table(void) {
+    struct file_descriptor_table *FD_table = NULL;
+
+    lock_acquire(object_cache_lock);
+    if (FD_table_cache_count > 0) {
+        FD_table = FD_table_cache[--FD_table_cache_count];
+    }
+    lock_release(object_cache_lock);
+
+    if (FD_table == NULL) {
+        FD_table = kmalloc(sizeof(struct file_descriptor_table));
+        if (FD_table == NULL) {
+            kprintf("Insufficient memory for file descriptor table");
+            return NULL;
+        }
+        if ((FD_table->lock = lock_create("FD_table_lock")) == NULL) {
+            kfree(FD_table);
+            return NULL;
+        }
+    }
+
+    FD_table->ioring = NULL;
+    FD_table->share_count = 1;
+
+    return FD_table;
+}
+
+// Keep the table and its lock for reuse, free them if the cache is full
+static void free_FD_table(struct file_descriptor_table *FD_table) {
+    lock_acquire(object_cache_lock);
+    if (FD_table_cache_count < FD_TABLE_CACHE_MAX) {
+        FD_table_cache[FD_table_cache_count++] = FD_table;
+        FD_table = NULL;
+    }
+    lock_release(object_cache_lock);
+
+    if (FD_table != NULL) {
+        lock_destroy(FD_table->lock);
+        kfree(FD_table);
+    }
+}
+
+struct file_descriptor_table *FD_table_create() {
+    struct file_descriptor_table *FD_table = alloc_FD_table();
+    if (FD_table == NULL) {
+        return NULL;
     }
-	
+
+    for (int i = 0; i < __OPEN_MAX; i++) {
+        FD_table->OF_node_ptr_array[i] = NULL;
+    }
+
+    // Connect 1 to stdout, line buffered, and 2 to stderr, which must not wait for a newline
+    struct open_file_node *console = get_console_node(&console_node, O_WRONLY);
+    ref_open_file(console);
+    FD_table->OF_node_ptr_array[1] = console;
+    console = get_console_node(&console_err_node, O_WRONLY | O_DIRECT);
+    ref_open_file(console);
+    FD_table->OF_node_ptr_array[2] = console;
+
     // Let the next fd start from 3
     FD_table->next = 3;
 
@@ -172,10 +696,92 @@ struct file_descriptor_table *FD_table_create() {
 }
 
 void FD_table_destroy(struct file_descriptor_table *FD_table) {
+    // Other processes still use a shared table
+    lock_acquire(FD_table->lock);
+    FD_table->share_count--;
+    int shared = FD_table->share_count > 0;
+    lock_release(FD_table->lock);
+    if (shared) return;
+
+    // Stop the async workers first, they use the descriptors
+    ioring_destroy(FD_table->ioring);
+
     for (int i = 0; i < __OPEN_MAX; i++) {
         close_fd(FD_table, i);
     }
-    kfree(FD_table);
+
+    // Output of an exiting process shows up before whoever waits on it runs
+    conbuf_flush();
+
+    free_FD_table(FD_table);
+}
+
+/* Return a private copy of the table, with every open file referenced
+ * once more. Caller holds FD_table->lock. NULL if out of memory.
+ */
+static struct file_descriptor_table *FD_table_clone(struct file_descriptor_table *FD_table) {
+    struct file_descriptor_table *copy = alloc_FD_table();
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->next = FD_table->next;
+
+    for (int i = 0; i < __OPEN_MAX; i++) {
+        copy->OF_node_ptr_array[i] = FD_table->OF_node_ptr_array[i];
+        if (copy->OF_node_ptr_array[i] != NULL) {
+            ref_open_file(copy->OF_node_ptr_array[i]);
+        }
+    }
+
+    return copy;
+}
+
+/* Give a forked child the parent's descriptors. The table is shared
+ * copy-on-write, so no descriptor is touched until one side changes
+ * its table. A table with an ioring is copied right away since the
+ * ring's workers belong to the parent. NULL if out of memory.
+ */
+struct file_descriptor_table *FD_table_fork(struct file_descriptor_table *FD_table) {
+    lock_acquire(FD_table->lock);
+
+    struct file_descriptor_table *child = FD_table;
+    if (FD_table->ioring != NULL) {
+        child = FD_table_clone(FD_table);
+    } else {
+        FD_table->share_count++;
+    }
+
+    lock_release(FD_table->lock);
+
+    return child;
+}
+
+/* Make the table at *FD_table_ptr private to the caller before it is
+ * changed, copying it if other processes share it. 0 on success,
+ * ENOMEM if the copy could not be made.
+ */
+int FD_table_unshare(struct file_descriptor_table **FD_table_ptr) {
+    struct file_descriptor_table *FD_table = *FD_table_ptr;
+
+    lock_acquire(FD_table->lock);
+
+    // The last user owns the table
+    if (FD_table->share_count == 1) {
+        lock_release(FD_table->lock);
+        return 0;
+    }
+
+    struct file_descriptor_table *copy = FD_table_clone(FD_table);
+    if (copy == NULL) {
+        lock_release(FD_table->lock);
+        return ENOMEM;
+    }
+    FD_table->share_count--;
+
+    lock_release(FD_table->lock);
+
+    *FD_table_ptr = copy;
+    return 0;
 }
 
 // Check if a fd table is full, 0 if not, 1 if full
@@ -183,7 +789,7 @@ int is_fd_table_full(struct file_descriptor_table *FD_table) {
     return FD_table->next == -1;
 }
 
-// Return an available fd
+// Return an available fd, caller holds FD_table->lock
 int get_next_fd(struct file_descriptor_table *FD_table) {
     int free = FD_table->next;
 
@@ -215,15 +821,66 @@ struct open_file *get_open_file(struct file_descriptor_table *FD_table, int fd)
     else return NULL;
 }
 
-/* If the fd is linked to an open file, close the fd and decrement
- * open file's reference count.
+/* Unlink the fd from its open file without dropping the reference,
+ * return the node, NULL if the fd was not open. Caller holds FD_table->lock.
  */
-void close_fd(struct file_descriptor_table *FD_table, int fd) {
-    if (FD_table->OF_node_ptr_array[fd] != NULL) {
-        close_open_file(FD_table->OF_node_ptr_array[fd]);
+static struct open_file_node *detach_fd(struct file_descriptor_table *FD_table, int fd) {
+    struct open_file_node *node = FD_table->OF_node_ptr_array[fd];
+    if (node != NULL) {
         FD_table->OF_node_ptr_array[fd] = NULL;
-        FD_table->next = fd;
+
+        // Keep the lowest known free fd cached
+        if (FD_table->next == -1 || fd < FD_table->next) {
+            FD_table->next = fd;
+        }
+    }
+    return node;
+}
+
+/* If the fd is linked to an open file, close the fd and decrement
+ * open file's reference count. Return the write-back error, if any.
+ */
+int close_fd(struct file_descriptor_table *FD_table, int fd) {
+    lock_acquire(FD_table->lock);
+    struct open_file_node *node = detach_fd(FD_table, fd);
+    lock_release(FD_table->lock);
+
+    if (node == NULL) return 0;
+    return close_open_file(node);
+}
+
+/* Link the node to the next free fd and return the fd, -1 if the table
+ * is full. The table takes over the caller's reference.
+ */
+int install_fd(struct file_descriptor_table *FD_table, struct open_file_node *node) {
+    lock_acquire(FD_table->lock);
+    if (is_fd_table_full(FD_table)) {
+        lock_release(FD_table->lock);
+        return -1;
+    }
+
+    int fd = get_next_fd(FD_table);
+    FD_table->OF_node_ptr_array[fd] = node;
+    lock_release(FD_table->lock);
+
+    return fd;
+}
+
+/* Return the node linked to the fd with an extra reference held, so a
+ * concurrent close cannot free it. NULL if the fd is not valid.
+ * Drop the reference with close_open_file.
+ */
+struct open_file_node *acquire_fd(struct file_descriptor_table *FD_table, int fd) {
+    if (fd < 0 || fd >= __OPEN_MAX) return NULL;
+
+    lock_acquire(FD_table->lock);
+    struct open_file_node *node = FD_table->OF_node_ptr_array[fd];
+    if (node != NULL) {
+        ref_open_file(node);
     }
+    lock_release(FD_table->lock);
+
+    return node;
 }
 
 /* Validate if a fd is valid, 0 if valid, -1 if not.
@@ -244,186 +901,277 @@ int validate_fd(struct file_descriptor_table *FD_table, int fd) {
 //                   syscall function                 //
 ////////////////////////////////////////////////////////
 
-int32_t sys_open(userptr_t filename, int flags, mode_t mode, int *errno) {
+// Set up a uio that transfers to or from the current process's buffer
+static void uio_uinit(struct iovec *iov, struct uio *uio, userptr_t buf, size_t len, off_t pos, enum uio_rw rw) {
+    iov->iov_ubase = buf;
+    iov->iov_len = len;
+    uio->uio_iov = iov;
+    uio->uio_iovcnt = 1;
+    uio->uio_offset = pos;
+    uio->uio_resid = len;
+    uio->uio_segflg = UIO_USERSPACE;
+    uio->uio_rw = rw;
+    uio->uio_space = proc_getas();
+}
+
+static int32_t do_sys_open(userptr_t filename, int flags, mode_t mode, int *errno) {
     //copy user path into os kernel memory
     int fd = 0;
-    char path[__NAME_MAX];
-    *errno = copyinstr(filename, path, __NAME_MAX, NULL);
+    char *path = kmalloc(__PATH_MAX);     // Too big for the kernel stack
+    if (path == NULL) {
+        *errno = ENOMEM;
+        return -1;
+    }
+    *errno = copyinstr(filename, path, __PATH_MAX, NULL);
     if(*errno){
+        kfree(path);
         return -1;
     }
 
-    //check if fd_table is full
+    //check if fd_table is full, the fd itself is taken once the file is open
     struct file_descriptor_table *FD_table = curproc->FD_table;
     if(is_fd_table_full(FD_table)){
+        kfree(path);
         *errno = EMFILE;
         return -1;
     }
-    fd = get_next_fd(curproc->FD_table);
 
-    //vfs_open to deal with vnode
+    //open the vnode, resolving the path through the name cache
     struct open_file *new_open_file = create_open_file();
-    *errno = vfs_open(path, flags, mode, &new_open_file->vnode);
+    if (new_open_file == NULL) {
+        kfree(path);
+        *errno = ENOMEM;
+        return -1;
+    }
+    *errno = namecache_open(path, flags, mode, &new_open_file->vnode);
+    kfree(path);
     if(*errno){
+        release_open_file(new_open_file);
         return -1;
     }
 
-    //add to open file linked-list and map to fd, record the open flags
-    struct open_file_node *new_node = NULL;
-    if ((new_node = add_open_file(new_open_file)) == NULL) {
-        // If not enough memory, the open file table is full
-        *errno = ENFILE;
+    // Attach the state shared by all opens of this vnode
+    if ((new_open_file->vinfo = vnode_info_get(new_open_file->vnode)) == NULL) {
+        vfs_close(new_open_file->vnode);
+        release_open_file(new_open_file);
+        *errno = ENOMEM;
         return -1;
     }
 
-    // Let the fd points to the new file and set the flags
-    curproc->FD_table->OF_node_ptr_array[fd] = new_node;
-    curproc->FD_table->OF_node_ptr_array[fd]->open_file->flags = flags;
+    /* Truncate like sys_ftruncate: under the append lock, after writing
+     * back blocks buffered through other open files, which would
+     * otherwise bring the old tail back */
+    if ((flags & O_TRUNC) == O_TRUNC) {
+        struct vnode_info *vinfo = new_open_file->vinfo;
+        lock_acquire(vinfo->append_lock);
+        *errno = filebuf_flush_vnode(new_open_file->vinfo);
+        if (*errno == 0) {
+            *errno = VOP_TRUNCATE(new_open_file->vnode, 0);
+        }
+        if (*errno == 0) {
+            vinfo->size = 0;
+        }
+        lock_release(vinfo->append_lock);
+
+        if (*errno) {
+            vnode_info_put(vinfo);
+            vfs_close(new_open_file->vnode);
+            release_open_file(new_open_file);
+            return -1;
+        }
+    }
+
+    //add to open file linked-list and map to fd, record the open flags
+    struct open_file_node *new_node = add_open_file(new_open_file);
+
+    // Taking an fd changes the table, stop sharing it first
+    new_open_file->flags = flags;
+    if ((*errno = FD_table_unshare(&curproc->FD_table)) != 0) {
+        close_open_file(new_node);
+        return -1;
+    }
+    FD_table = curproc->FD_table;
 
-    if ((flags & O_APPEND) == O_APPEND) {
-        struct stat stat;
-        VOP_STAT(new_open_file->vnode, &stat);
-        new_open_file->offset = stat.st_size;
+    // Let the fd point to the new file
+    if ((fd = install_fd(FD_table, new_node)) == -1) {
+        close_open_file(new_node);
+        *errno = EMFILE;
+        return -1;
     }
 
+    // O_APPEND is enforced by sys_write on every write, not here
     return fd;
 }
 
-int32_t sys_close(int fd, int *errno){
+static int32_t do_sys_close(int fd, int *errno){
     if (validate_fd(curproc->FD_table, fd) != 0) {
         *errno = EBADF;
         return -1;
     }
 
-    close_fd(curproc->FD_table, fd);
+    // Closing changes the table, stop sharing it first
+    if ((*errno = FD_table_unshare(&curproc->FD_table)) != 0) {
+        return -1;
+    }
+    struct file_descriptor_table *FD_table = curproc->FD_table;
+
+    lock_acquire(FD_table->lock);
+    struct open_file_node *node = detach_fd(FD_table, fd);
+    lock_release(FD_table->lock);
+
+    if (node == NULL) {
+        *errno = EBADF;
+        return -1;
+    }
+
+    // Report data that could not be written back
+    int result = close_open_file(node);
+    if (result) {
+        *errno = result;
+        return -1;
+    }
 
     return 0;
 }
 
-ssize_t sys_read(int fd, userptr_t buf, size_t buflen, int *errno) {
+static ssize_t do_sys_read(int fd, userptr_t buf, size_t buflen, int *errno) {
     // Validate fd
-    if (validate_fd(curproc->FD_table, fd) != 0) {
+    struct open_file_node *node = acquire_fd(curproc->FD_table, fd);
+    if (node == NULL) {
         *errno = EBADF;
         return -1;
     }
 
     // flags need to be one of R or R/W
-    struct open_file *file = get_open_file(curproc->FD_table, fd);
+    struct open_file *file = node->open_file;
     int flags = file->flags;
     if (((flags & O_ACCMODE) != O_RDONLY) && ((flags & O_ACCMODE) != O_RDWR)) {
+        close_open_file(node);
         *errno = EBADF;
         return -1;
     }
 
-    // Set up struct to be used in vop_read
+    // Set up struct to be used in vop_read, the offset is filled in by open_file_io
     struct uio uio;
     struct iovec iovec;
-    uio_kinit(&iovec, &uio, buf, buflen, file->offset, UIO_READ);
+    uio_uinit(&iovec, &uio, buf, buflen, 0, UIO_READ);
 
-    lock_acquire(file->mutex);
+    *errno = open_file_io(file, &uio);
+    close_open_file(node);
 
-    *errno = VOP_READ(file->vnode, &uio);
     if (*errno != 0) return -1;
 
-    // Update the offset to the open file
-    ssize_t num_bytes_read = buflen - uio.uio_resid;
-    file->offset = uio.uio_offset;
-
-    lock_release(file->mutex);
-
-    return num_bytes_read;
+    return buflen - uio.uio_resid;
 }
 
-ssize_t sys_write(int fd, userptr_t buf, size_t nbytes, int *errno) {
+static ssize_t do_sys_write(int fd, userptr_t buf, size_t nbytes, int *errno) {
     // Validate fd
-    if (validate_fd(curproc->FD_table, fd) != 0) {
+    struct open_file_node *node = acquire_fd(curproc->FD_table, fd);
+    if (node == NULL) {
         *errno = EBADF;
         return -1;
     }
 
     // flags need to be one of W or R/W
-    struct open_file *file = get_open_file(curproc->FD_table, fd);
+    struct open_file *file = node->open_file;
     int flags = file->flags;
     if (((flags & O_ACCMODE) != O_WRONLY) && ((flags & O_ACCMODE) != O_RDWR)) {
+        close_open_file(node);
         *errno = EBADF;
         return -1;
     }
 
-    // Set up struct to be used in vop_read
+    // Set up struct to be used in vop_write, the offset is filled in by open_file_io
     struct uio uio;
     struct iovec iovec;
-    uio_kinit(&iovec, &uio, buf, nbytes, file->offset, UIO_WRITE);
+    uio_uinit(&iovec, &uio, buf, nbytes, 0, UIO_WRITE);
 
-    lock_acquire(file->mutex);
+    *errno = open_file_io(file, &uio);
+    close_open_file(node);
 
-    *errno = VOP_WRITE(file->vnode, &uio);
     if (*errno != 0) return -1;
 
-    // Update the offset to the open file
-    ssize_t num_bytes_wrote = nbytes - uio.uio_resid;
-    file->offset = uio.uio_offset;
-
-    lock_release(file->mutex);
-
-    return num_bytes_wrote;
+    return nbytes - uio.uio_resid;
 }
 
-int sys_dup2(int oldfd, int newfd, int *errno) {
+static int do_sys_dup2(int oldfd, int newfd, int *errno) {
     // Validate fd
-    if (validate_fd(curproc->FD_table, oldfd) != 0 || (newfd < 0 || newfd >= __OPEN_MAX)) {
+    if (validate_fd(curproc->FD_table, oldfd) != 0 || newfd < 0 || newfd >= __OPEN_MAX) {
         *errno = EBADF;
         return -1;
     }
 
-    // No effect if the two fd are equal
-    if (oldfd == newfd) return newfd;
-
+    // Stop sharing the table before changing it
+    if ((*errno = FD_table_unshare(&curproc->FD_table)) != 0) {
+        return -1;
+    }
     struct file_descriptor_table *FD_table = curproc->FD_table;
 
-    // Close the newfd if it is linked to an open file
-    if (FD_table->OF_node_ptr_array[newfd] != NULL) {
-        close_fd(FD_table, newfd);
+    lock_acquire(FD_table->lock);
 
-        // Move to another free fd
-        get_next_fd(FD_table);
+    struct open_file_node *node = FD_table->OF_node_ptr_array[oldfd];
+    if (node == NULL) {
+        lock_release(FD_table->lock);
+        *errno = EBADF;
+        return -1;
+    }
+
+    // No effect if the two fd are equal
+    if (oldfd == newfd) {
+        lock_release(FD_table->lock);
+        return newfd;
     }
 
+    // Unlink the newfd if it is linked to an open file, it is closed below
+    struct open_file_node *replaced = detach_fd(FD_table, newfd);
+
     // Let newfd point to where oldfd points, and increment the reference count
-    FD_table->OF_node_ptr_array[newfd] = FD_table->OF_node_ptr_array[oldfd];
-    
-    struct open_file *file = get_open_file(curproc->FD_table, newfd);
-    lock_acquire(file->mutex);
+    ref_open_file(node);
+    FD_table->OF_node_ptr_array[newfd] = node;
 
-    file->reference_count++;
+    // Move the cached free fd off newfd
+    if (FD_table->next == newfd) {
+        get_next_fd(FD_table);
+    }
 
-    lock_release(file->mutex);
+    lock_release(FD_table->lock);
+
+    if (replaced != NULL) {
+        close_open_file(replaced);
+    }
 
     return newfd;
 }
 
-uint64_t sys_lseek(int fd, uint64_t pos, int whence, int *errno) {
-    struct stat stat;
+static uint64_t do_sys_lseek(int fd, uint64_t pos, int whence, int *errno) {
     struct open_file *opf;
     off_t  newpos;
+    off_t  size = 0;
 
     //check if fd is valid
-    if(validate_fd(curproc->FD_table, fd) != 0){
+    struct open_file_node *node = acquire_fd(curproc->FD_table, fd);
+    if(node == NULL){
         *errno = EBADF;
         return -1;
     }
 
-    //check if vnode is seekable
-    opf = get_open_file(curproc->FD_table, fd);
-    if (VOP_ISSEEKABLE(opf->vnode) == 0) {
+    //check if vnode is seekable, pipes never are
+    opf = node->open_file;
+    if (opf->pipe != NULL || !opf->vinfo->seekable) {
+        close_open_file(node);
         *errno = ESPIPE;
         return -1;
     }
 
-    if (VOP_STAT(opf->vnode,&stat) != 0) {
-        *errno = EINVAL;
-        return -1;
+    // The cached size already counts buffered writes
+    if (whence == SEEK_END) {
+        lock_acquire(opf->vinfo->append_lock);
+        size = opf->vinfo->size;
+        lock_release(opf->vinfo->append_lock);
     }
 
+    open_file_lock(opf);
+
     //case whence
     switch(whence){
         case SEEK_SET:
@@ -433,18 +1181,305 @@ uint64_t sys_lseek(int fd, uint64_t pos, int whence, int *errno) {
             newpos = pos + opf->offset;
             break;
         case SEEK_END:
-            newpos = stat.st_size + pos;
+            newpos = size + pos;
             break;
         default:
-            *errno = EINVAL;
-            return -1;
+            newpos = -1;
+            break;
     }
 
     if(newpos<0){
+        lock_release(opf->mutex);
+        close_open_file(node);
         *errno = EINVAL;
         return -1;
     }
 
     opf->offset = newpos;
+
+    lock_release(opf->mutex);
+    close_open_file(node);
+
     return newpos;
-}
\ No newline at end of file
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//              instrumented syscall entry            //
+////////////////////////////////////////////////////////
+
+int32_t sys_open(userptr_t filename, int flags, mode_t mode, int *errno) {
+    struct timespec start;
+    fstats_start(&start);
+    int32_t result = do_sys_open(filename, flags, mode, errno);
+    fstats_end(FSTATS_OPEN, &start, result == -1 ? *errno : 0, 0);
+    return result;
+}
+
+int32_t sys_close(int fd, int *errno) {
+    struct timespec start;
+    fstats_start(&start);
+    int32_t result = do_sys_close(fd, errno);
+    fstats_end(FSTATS_CLOSE, &start, result == -1 ? *errno : 0, 0);
+    return result;
+}
+
+ssize_t sys_read(int fd, userptr_t buf, size_t buflen, int *errno) {
+    struct timespec start;
+    fstats_start(&start);
+    ssize_t result = do_sys_read(fd, buf, buflen, errno);
+    fstats_end(FSTATS_READ, &start, result == -1 ? *errno : 0, result == -1 ? 0 : result);
+    return result;
+}
+
+ssize_t sys_write(int fd, userptr_t buf, size_t nbytes, int *errno) {
+    struct timespec start;
+    fstats_start(&start);
+    ssize_t result = do_sys_write(fd, buf, nbytes, errno);
+    fstats_end(FSTATS_WRITE, &start, result == -1 ? *errno : 0, result == -1 ? 0 : result);
+    return result;
+}
+
+int sys_dup2(int oldfd, int newfd, int *errno) {
+    struct timespec start;
+    fstats_start(&start);
+    int result = do_sys_dup2(oldfd, newfd, errno);
+    fstats_end(FSTATS_DUP2, &start, result == -1 ? *errno : 0, 0);
+    return result;
+}
+
+uint64_t sys_lseek(int fd, uint64_t pos, int whence, int *errno) {
+    struct timespec start;
+    fstats_start(&start);
+    uint64_t result = do_sys_lseek(fd, pos, whence, errno);
+    fstats_end(FSTATS_LSEEK, &start, result == (uint64_t)-1 ? *errno : 0, 0);
+    return result;
+}
+
+int sys_fsync(int fd, int *errno) {
+    struct open_file_node *node = acquire_fd(curproc->FD_table, fd);
+    if (node == NULL) {
+        *errno = EBADF;
+        return -1;
+    }
+
+    // Nothing to make durable behind a pipe
+    struct open_file *file = node->open_file;
+    if (file->pipe != NULL) {
+        close_open_file(node);
+        *errno = EINVAL;
+        return -1;
+    }
+
+    open_file_lock(file);
+
+    // Write back buffered data, then ask the file system to make it durable
+    *errno = filebuf_flush_vnode(file->vinfo);
+    if (*errno == 0) {
+        *errno = VOP_FSYNC(file->vnode);
+    }
+
+    lock_release(file->mutex);
+    close_open_file(node);
+
+    return *errno ? -1 : 0;
+}
+
+/* Set the size of the file to len, dropping or zero-filling the tail.
+ * Keeps the cached size in step so seeks and appends see the new end.
+ */
+int sys_ftruncate(int fd, off_t len, int *errno) {
+    struct open_file_node *node = acquire_fd(curproc->FD_table, fd);
+    if (node == NULL) {
+        *errno = EBADF;
+        return -1;
+    }
+
+    // Needs to be a regular file open for writing
+    struct open_file *file = node->open_file;
+    int mode = file->flags & O_ACCMODE;
+    if (mode != O_WRONLY && mode != O_RDWR) {
+        *errno = EBADF;
+    } else if (file->pipe != NULL || !file->vinfo->seekable || len < 0) {
+        *errno = EINVAL;
+    } else {
+        /* Hold the append lock so no append lands between the truncate and
+         * the size update. Buffered blocks past the new end are written
+         * back first so they cannot resurrect the tail later */
+        struct vnode_info *vinfo = file->vinfo;
+        lock_acquire(vinfo->append_lock);
+        *errno = filebuf_flush_vnode(file->vinfo);
+        if (*errno == 0) {
+            *errno = VOP_TRUNCATE(file->vnode, len);
+        }
+        if (*errno == 0) {
+            vinfo->size = len;
+        }
+        lock_release(vinfo->append_lock);
+    }
+
+    close_open_file(node);
+
+    return *errno ? -1 : 0;
+}
+
+int sys_sync(int *errno) {
+    int result = filebuf_flush_all();
+
+    *errno = vfs_sync();
+    if (*errno == 0) {
+        *errno = result;
+    }
+
+    return *errno ? -1 : 0;
+}
+
+/* Copy up to len bytes from infd's offset to outfd's offset without
+ * passing through user space. Both offsets advance by the amount copied,
+ * which is short only at end of input.
+ */
+ssize_t sys_copy_file_range(int infd, int outfd, size_t len, int *errno) {
+    struct file_descriptor_table *FD_table = curproc->FD_table;
+    struct open_file_node *innode = acquire_fd(FD_table, infd);
+    struct open_file_node *outnode = acquire_fd(FD_table, outfd);
+    if (innode == NULL || outnode == NULL) {
+        if (innode != NULL) close_open_file(innode);
+        if (outnode != NULL) close_open_file(outnode);
+        *errno = EBADF;
+        return -1;
+    }
+
+    // Input needs to be readable, output writable
+    struct open_file *in = innode->open_file;
+    struct open_file *out = outnode->open_file;
+    int inmode = in->flags & O_ACCMODE;
+    int outmode = out->flags & O_ACCMODE;
+    char *chunk = NULL;
+    if ((inmode != O_RDONLY && inmode != O_RDWR) || (outmode != O_WRONLY && outmode != O_RDWR)) {
+        *errno = EBADF;
+    } else if ((chunk = kmalloc(COPY_CHUNK_SIZE)) == NULL) {
+        *errno = ENOMEM;
+    }
+    if (chunk == NULL) {
+        close_open_file(innode);
+        close_open_file(outnode);
+        return -1;
+    }
+
+    // Lock both open files in address order so two copies cannot deadlock
+    struct open_file *first = in < out ? in : out;
+    struct open_file *second = in < out ? out : in;
+    open_file_lock(first);
+    if (second != first) open_file_lock(second);
+
+    size_t copied = 0;
+    *errno = 0;
+    while (copied < len) {
+        size_t want = len - copied;
+        if (want > COPY_CHUNK_SIZE) want = COPY_CHUNK_SIZE;
+
+        struct uio uio;
+        struct iovec iovec;
+        uio_kinit(&iovec, &uio, chunk, want, 0, UIO_READ);
+        if ((*errno = open_file_read(in, &uio)) != 0) break;
+
+        // End of input
+        size_t got = want - uio.uio_resid;
+        if (got == 0) break;
+
+        uio_kinit(&iovec, &uio, chunk, got, 0, UIO_WRITE);
+        if ((*errno = open_file_write(out, &uio)) != 0) break;
+
+        copied += got - uio.uio_resid;
+        if (uio.uio_resid != 0) break;
+    }
+
+    if (second != first) lock_release(second->mutex);
+    lock_release(first->mutex);
+    kfree(chunk);
+    close_open_file(innode);
+    close_open_file(outnode);
+
+    // Report partial progress, the error shows up on the next call
+    if (*errno != 0 && copied == 0) return -1;
+    *errno = 0;
+
+    return copied;
+}
+
+static int do_sys_remove(userptr_t pathname, char *path, char *name, int *errno) {
+    struct vnode *dir;
+
+    *errno = copyinstr(pathname, path, __PATH_MAX, NULL);
+    if (*errno) return -1;
+
+    // Find the cache key before vfs_remove, which modifies path
+    *errno = namecache_lookparent(path, &dir, name, __NAME_MAX + 1);
+    if (*errno) return -1;
+
+    *errno = vfs_remove(path);
+
+    // Drop the entry even on failure, a stale positive entry costs only a lookup
+    namecache_invalidate(dir, name);
+    VOP_DECREF(dir);
+
+    return *errno ? -1 : 0;
+}
+
+int sys_remove(userptr_t pathname, int *errno) {
+    // The path and its last component, too big for the kernel stack
+    char *path = kmalloc(__PATH_MAX + __NAME_MAX + 1);
+    if (path == NULL) {
+        *errno = ENOMEM;
+        return -1;
+    }
+
+    int result = do_sys_remove(pathname, path, path + __PATH_MAX, errno);
+    kfree(path);
+    return result;
+}
+
+static int do_sys_rename(userptr_t oldname, userptr_t newname, char *oldpath, char *newpath, int *errno) {
+    char *oldlast = oldpath + __PATH_MAX;
+    char *newlast = newpath + __PATH_MAX;
+    struct vnode *olddir;
+    struct vnode *newdir;
+
+    *errno = copyinstr(oldname, oldpath, __PATH_MAX, NULL);
+    if (*errno) return -1;
+    *errno = copyinstr(newname, newpath, __PATH_MAX, NULL);
+    if (*errno) return -1;
+
+    // Find both cache keys before vfs_rename, which modifies the paths
+    *errno = namecache_lookparent(oldpath, &olddir, oldlast, __NAME_MAX + 1);
+    if (*errno) return -1;
+    *errno = namecache_lookparent(newpath, &newdir, newlast, __NAME_MAX + 1);
+    if (*errno) {
+        VOP_DECREF(olddir);
+        return -1;
+    }
+
+    *errno = vfs_rename(oldpath, newpath);
+
+    // The old name is gone and the new one may have been negative or replaced
+    namecache_invalidate(olddir, oldlast);
+    namecache_invalidate(newdir, newlast);
+    VOP_DECREF(olddir);
+    VOP_DECREF(newdir);
+
+    return *errno ? -1 : 0;
+}
+
+int sys_rename(userptr_t oldname, userptr_t newname, int *errno) {
+    // Each path is followed by its last component, too big for the kernel stack
+    size_t len = __PATH_MAX + __NAME_MAX + 1;
+    char *paths = kmalloc(2 * len);
+    if (paths == NULL) {
+        *errno = ENOMEM;
+        return -1;
+    }
+
+    int result = do_sys_rename(oldname, newname, paths, paths + len, errno);
+    kfree(paths);
+    return result;
+}
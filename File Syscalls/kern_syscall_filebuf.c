@@ -0,0 +1,404 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <clock.h>
+#include <vnode.h>
+#include <proc.h>
+#include <file.h>
+#include <filebuf.h>
+#include <conbuf.h>
+
+/*
+ * Delayed write-back for regular files.
+ *
+ * sys_write copies data into block sized buffers instead of calling
+ * VOP_WRITE. A flusher thread writes buffers back once they are older than
+ * FILEBUF_FLUSH_AGE, and writers flush everything themselves once
+ * FILEBUF_MAX_DIRTY buffers are pending. Buffers of one vnode are always
+ * written together, sorted by block, with adjacent blocks coalesced into a
+ * single VOP_WRITE.
+ *
+ * filebuf_lock guards the list, not the I/O. A writer marks its buffer
+ * busy and copies from user memory without the lock, and a flush takes
+ * the vnode's buffers off the list and writes them without it. Only one
+ * flush of a vnode runs at a time, so an older copy of a block never
+ * lands after a newer one.
+ *
+ * If a write-back fails the data is dropped and the first error is kept
+ * in the vnode_info until the next fsync, close or flush by a writer of
+ * that vnode reports it.
+ */
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 dirty list functions               //
+////////////////////////////////////////////////////////
+
+static struct filebuf *dirty_list = NULL;       // Sentinel, oldest buffer first
+static int num_dirty = 0;
+static struct lock *filebuf_lock = NULL;
+static struct cv *filebuf_cv = NULL;            // A buffer or a flush is done
+static int flusher_exit = 0;
+
+static time_t filebuf_now(void) {
+    struct timespec ts;
+    gettime(&ts);
+    return ts.tv_sec;
+}
+
+// Return the buffer holding the block of the vnode, NULL if not buffered
+static struct filebuf *find_filebuf(struct vnode_info *vinfo, off_t block) {
+    struct filebuf *curr;
+    for (curr = dirty_list->next; curr != dirty_list; curr = curr->next) {
+        if (curr->vinfo == vinfo && curr->block == block) return curr;
+    }
+    return NULL;
+}
+
+// Create an empty buffer for the block and append it to the dirty list
+static struct filebuf *new_filebuf(struct vnode_info *vinfo, off_t block) {
+    struct filebuf *buf = kmalloc(sizeof(struct filebuf));
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    buf->vinfo = vinfo;
+    buf->block = block;
+    buf->dirty_start = 0;
+    buf->dirty_end = 0;
+    buf->dirtied = filebuf_now();
+    buf->busy = 0;
+
+    buf->next = dirty_list;
+    buf->prev = dirty_list->prev;
+    dirty_list->prev = buf;
+    buf->prev->next = buf;
+    num_dirty++;
+    vinfo->dirty++;
+
+    return buf;
+}
+
+// Take the buffer off the dirty list, it still counts as dirty for its vnode
+static void unlink_filebuf(struct filebuf *buf) {
+    buf->prev->next = buf->next;
+    buf->next->prev = buf->prev;
+    num_dirty--;
+}
+
+static void free_filebuf(struct filebuf *buf) {
+    unlink_filebuf(buf);
+    buf->vinfo->dirty--;
+
+    kfree(buf);
+}
+
+// Return the oldest buffer nobody is filling or flushing, NULL if none
+static struct filebuf *oldest_idle(void) {
+    struct filebuf *curr;
+    for (curr = dirty_list->next; curr != dirty_list; curr = curr->next) {
+        if (!curr->busy && !curr->vinfo->flushing) return curr;
+    }
+    return NULL;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 write-back functions               //
+////////////////////////////////////////////////////////
+
+// Check if b continues the dirty data of a on disk, 1 if so
+static int is_contiguous(struct filebuf *a, struct filebuf *b) {
+    return a->dirty_end == FILEBUF_BLOCK_SIZE && b->dirty_start == 0 && b->block == a->block + 1;
+}
+
+// Write out n buffers whose dirty ranges are contiguous with one VOP_WRITE
+static int write_run(struct filebuf **run, int n) {
+    struct iovec iov[FILEBUF_MAX_IOV];
+    struct uio uio;
+    size_t total = 0;
+
+    KASSERT(n > 0 && n <= FILEBUF_MAX_IOV);
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_kbase = run[i]->data + run[i]->dirty_start;
+        iov[i].iov_len = run[i]->dirty_end - run[i]->dirty_start;
+        total += iov[i].iov_len;
+    }
+
+    uio.uio_iov = iov;
+    uio.uio_iovcnt = n;
+    uio.uio_offset = run[0]->block * FILEBUF_BLOCK_SIZE + run[0]->dirty_start;
+    uio.uio_resid = total;
+    uio.uio_segflg = UIO_SYSSPACE;
+    uio.uio_rw = UIO_WRITE;
+    uio.uio_space = NULL;
+
+    int result = VOP_WRITE(run[0]->vinfo->vnode, &uio);
+    if (result == 0 && uio.uio_resid != 0) {
+        // Short write, the device is full
+        result = ENOSPC;
+    }
+    return result;
+}
+
+/* Write back and free every buffer of the vnode in ascending block order,
+ * except those being filled. Return the first error, which is also kept
+ * in the vnode_info. Caller holds filebuf_lock, which is dropped while
+ * the buffers are written.
+ */
+static int flush_vnode_locked(struct vnode_info *vinfo) {
+    struct filebuf *sorted[FILEBUF_MAX_DIRTY];
+    int n = 0;
+
+    // One flush of a vnode at a time
+    while (vinfo->flushing) {
+        cv_wait(filebuf_cv, filebuf_lock);
+    }
+    vinfo->flushing = 1;
+
+    // Insertion sort the vnode's buffers by block number
+    struct filebuf *curr;
+    for (curr = dirty_list->next; curr != dirty_list; curr = curr->next) {
+        if (curr->vinfo != vinfo || curr->busy) continue;
+
+        KASSERT(n < FILEBUF_MAX_DIRTY);
+        int i = n++;
+        while (i > 0 && sorted[i - 1]->block > curr->block) {
+            sorted[i] = sorted[i - 1];
+            i--;
+        }
+        sorted[i] = curr;
+    }
+
+    // Nobody else can reach them now
+    for (int i = 0; i < n; i++) {
+        unlink_filebuf(sorted[i]);
+    }
+    lock_release(filebuf_lock);
+
+    // Write each contiguous run with a single VOP_WRITE
+    int result = 0;
+    int start = 0;
+    while (start < n) {
+        int len = 1;
+        while (start + len < n && len < FILEBUF_MAX_IOV &&
+               is_contiguous(sorted[start + len - 1], sorted[start + len])) {
+            len++;
+        }
+
+        int err = write_run(&sorted[start], len);
+        if (err != 0 && result == 0) result = err;
+        start += len;
+    }
+
+    for (int i = 0; i < n; i++) {
+        kfree(sorted[i]);
+    }
+
+    lock_acquire(filebuf_lock);
+    vinfo->dirty -= n;
+    if (result != 0 && vinfo->wb_error == 0) {
+        vinfo->wb_error = result;
+    }
+    vinfo->flushing = 0;
+    cv_broadcast(filebuf_cv, filebuf_lock);
+
+    return result;
+}
+
+// Return and clear the vnode's pending write-back error, caller holds filebuf_lock
+static int take_error(struct vnode_info *vinfo) {
+    int result = vinfo->wb_error;
+    vinfo->wb_error = 0;
+    return result;
+}
+
+/* Write back every dirty buffer nobody is filling, return the first
+ * error. Caller holds filebuf_lock.
+ */
+static int flush_all_locked(void) {
+    int result = 0;
+    struct filebuf *buf;
+    while ((buf = oldest_idle()) != NULL) {
+        int err = flush_vnode_locked(buf->vinfo);
+        if (err != 0 && result == 0) result = err;
+    }
+    return result;
+}
+
+/* Write back every vnode that has a buffer older than FILEBUF_FLUSH_AGE.
+ * Errors wait in the vnode_info for the vnode's next fsync or close.
+ */
+static void flush_aged_locked(void) {
+    time_t now = filebuf_now();
+    struct filebuf *buf;
+    while ((buf = oldest_idle()) != NULL && now - buf->dirtied >= FILEBUF_FLUSH_AGE) {
+        flush_vnode_locked(buf->vinfo);
+    }
+}
+
+static void filebuf_flusher(void *unused1, unsigned long unused2) {
+    (void)unused1;
+    (void)unused2;
+
+    while (1) {
+        clocksleep(FILEBUF_FLUSH_INTERVAL);
+
+        lock_acquire(filebuf_lock);
+        if (flusher_exit) {
+            lock_release(filebuf_lock);
+            thread_exit();
+        }
+        flush_aged_locked();
+        lock_release(filebuf_lock);
+
+        // Console output without a newline rides on the same timer
+        conbuf_flush();
+    }
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 interface functions                //
+////////////////////////////////////////////////////////
+
+// Initialize the dirty list and start the flusher thread
+void filebuf_bootstrap() {
+    dirty_list = kmalloc(sizeof(struct filebuf));
+    filebuf_lock = lock_create("filebuf_lock");
+    filebuf_cv = cv_create("filebuf_cv");
+    if (dirty_list == NULL || filebuf_lock == NULL || filebuf_cv == NULL) {
+        panic("Insufficient memory for file buffer cache\n");
+    }
+
+    dirty_list->prev = dirty_list;
+    dirty_list->next = dirty_list;
+    dirty_list->vinfo = NULL;
+
+    if (thread_fork("filebuf flusher", kproc, filebuf_flusher, NULL, 0) != 0) {
+        panic("Cannot start file buffer flusher\n");
+    }
+}
+
+/* Write everything back and stop the flusher. The lock and sentinel are
+ * left in place since the flusher may still be asleep.
+ */
+void filebuf_shutdown() {
+    lock_acquire(filebuf_lock);
+    flusher_exit = 1;
+    int err = flush_all_locked();
+    if (err != 0) {
+        kprintf("filebuf: write-back failed at shutdown: error %d\n", err);
+    }
+    lock_release(filebuf_lock);
+}
+
+/* Copy the data described by uio into dirty buffers of the vnode and
+ * advance uio as VOP_WRITE would.
+ */
+int filebuf_write(struct vnode_info *vinfo, struct uio *uio) {
+    int result = 0;
+
+    lock_acquire(filebuf_lock);
+
+    while (uio->uio_resid > 0) {
+        off_t block = uio->uio_offset / FILEBUF_BLOCK_SIZE;
+        unsigned start = uio->uio_offset % FILEBUF_BLOCK_SIZE;
+        unsigned len = FILEBUF_BLOCK_SIZE - start;
+        if (len > uio->uio_resid) len = uio->uio_resid;
+        unsigned end = start + len;
+
+        struct filebuf *buf = find_filebuf(vinfo, block);
+
+        // Another writer is filling the block
+        if (buf != NULL && buf->busy) {
+            cv_wait(filebuf_cv, filebuf_lock);
+            continue;
+        }
+
+        // A buffer tracks a single dirty range, write it out if this would leave a gap
+        if (buf != NULL && (end < buf->dirty_start || start > buf->dirty_end)) {
+            flush_vnode_locked(vinfo);
+            result = take_error(vinfo);
+            if (result) break;
+            continue;
+        }
+
+        if (buf == NULL && num_dirty >= FILEBUF_MAX_DIRTY) {
+            /* Too much pending data, write some back before buffering
+             * more. Failures are kept for the vnodes they belong to */
+            struct filebuf *old = oldest_idle();
+            if (old != NULL) {
+                flush_vnode_locked(old->vinfo);
+            } else {
+                cv_wait(filebuf_cv, filebuf_lock);
+            }
+            continue;
+        }
+
+        if (buf == NULL && (buf = new_filebuf(vinfo, block)) == NULL) {
+            result = ENOMEM;
+            break;
+        }
+
+        // Copy from the user holding only this buffer
+        buf->busy = 1;
+        lock_release(filebuf_lock);
+        result = uiomove(buf->data + start, len, uio);
+        lock_acquire(filebuf_lock);
+        buf->busy = 0;
+        cv_broadcast(filebuf_cv, filebuf_lock);
+
+        if (result) {
+            if (buf->dirty_start == buf->dirty_end) free_filebuf(buf);
+            break;
+        }
+
+        // Grow the dirty range to cover the new data
+        if (buf->dirty_start == buf->dirty_end) {
+            buf->dirty_start = start;
+            buf->dirty_end = end;
+        } else {
+            if (start < buf->dirty_start) buf->dirty_start = start;
+            if (end > buf->dirty_end) buf->dirty_end = end;
+        }
+    }
+
+    lock_release(filebuf_lock);
+
+    return result;
+}
+
+/* Write back all buffered data of the vnode and return the first error
+ * since the last report, write-backs by the flusher included.
+ */
+int filebuf_flush_vnode(struct vnode_info *vinfo) {
+    lock_acquire(filebuf_lock);
+    flush_vnode_locked(vinfo);
+    int result = take_error(vinfo);
+    lock_release(filebuf_lock);
+
+    return result;
+}
+
+/* Write back all buffered data of the vnode for a reader. An error is
+ * left for the vnode's next fsync or close.
+ */
+void filebuf_writeback_vnode(struct vnode_info *vinfo) {
+    lock_acquire(filebuf_lock);
+    flush_vnode_locked(vinfo);
+    lock_release(filebuf_lock);
+}
+
+// Write back all buffered data
+int filebuf_flush_all() {
+    lock_acquire(filebuf_lock);
+    int result = flush_all_locked();
+    lock_release(filebuf_lock);
+
+    return result;
+}
@@ -0,0 +1,208 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fstats.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <clock.h>
+#include <copyinout.h>
+#include <fstats.h>
+
+/*
+ * Per-CPU statistics for the file syscalls.
+ *
+ * Each CPU only updates its own counters, with interrupts off so a
+ * thread cannot be switched out halfway through an update, so no lock
+ * is taken on the syscall path. Snapshots and resets walk every CPU
+ * without stopping the others and may miss the calls in flight.
+ */
+
+static struct fstats *percpu_stats = NULL;
+static unsigned num_stats_cpus = 0;
+
+static const char *syscall_names[FSTATS_NSYSCALLS] = {
+    "open", "read", "write", "lseek", "dup2", "close",
+};
+
+// Nanoseconds elapsed since start
+static uint64_t elapsed_ns(const struct timespec *start) {
+    struct timespec now, diff;
+    gettime(&now);
+    timespec_sub(&now, start, &diff);
+    return (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+}
+
+// Histogram bucket of a latency, see kern/fstats.h
+static int latency_bucket(uint64_t ns) {
+    int bucket = 0;
+    ns >>= 10;
+    while (ns != 0 && bucket < FSTATS_NBUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 recording functions                //
+////////////////////////////////////////////////////////
+
+// Allocate the counters once every CPU is up
+void fstats_bootstrap() {
+    num_stats_cpus = cpu_numcpus();
+    percpu_stats = kmalloc(num_stats_cpus * sizeof(struct fstats));
+    if (percpu_stats == NULL) {
+        panic("Insufficient memory for file syscall statistics\n");
+    }
+    bzero(percpu_stats, num_stats_cpus * sizeof(struct fstats));
+}
+
+void fstats_start(struct timespec *start) {
+    gettime(start);
+}
+
+// Record one call, err is 0 on success
+void fstats_end(int syscall, const struct timespec *start, int err, size_t bytes) {
+    if (percpu_stats == NULL) return;
+
+    KASSERT(syscall >= 0 && syscall < FSTATS_NSYSCALLS);
+    uint64_t ns = elapsed_ns(start);
+
+    int spl = splhigh();
+    struct fstats_syscall *stats = &percpu_stats[curcpu->c_number].sys[syscall];
+    stats->calls++;
+    stats->bytes += bytes;
+    stats->total_ns += ns;
+    stats->latency[latency_bucket(ns)]++;
+    if (err != 0) {
+        stats->errors[err < FSTATS_NERRNO ? err : FSTATS_NERRNO - 1]++;
+    }
+    splx(spl);
+}
+
+// Record the time taken to acquire an open_file mutex
+void fstats_mutex_wait(const struct timespec *start) {
+    if (percpu_stats == NULL) return;
+
+    uint64_t ns = elapsed_ns(start);
+
+    int spl = splhigh();
+    struct fstats *stats = &percpu_stats[curcpu->c_number];
+    stats->mutex_acquires++;
+    stats->mutex_wait_ns += ns;
+    splx(spl);
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 reporting functions                //
+////////////////////////////////////////////////////////
+
+// Sum the counters of every CPU into total
+void fstats_snapshot(struct fstats *total) {
+    bzero(total, sizeof(struct fstats));
+    if (percpu_stats == NULL) return;
+
+    for (unsigned cpu = 0; cpu < num_stats_cpus; cpu++) {
+        struct fstats *stats = &percpu_stats[cpu];
+        for (int i = 0; i < FSTATS_NSYSCALLS; i++) {
+            total->sys[i].calls += stats->sys[i].calls;
+            total->sys[i].bytes += stats->sys[i].bytes;
+            total->sys[i].total_ns += stats->sys[i].total_ns;
+            for (int e = 0; e < FSTATS_NERRNO; e++) {
+                total->sys[i].errors[e] += stats->sys[i].errors[e];
+            }
+            for (int b = 0; b < FSTATS_NBUCKETS; b++) {
+                total->sys[i].latency[b] += stats->sys[i].latency[b];
+            }
+        }
+        total->mutex_acquires += stats->mutex_acquires;
+        total->mutex_wait_ns += stats->mutex_wait_ns;
+    }
+}
+
+void fstats_reset() {
+    if (percpu_stats == NULL) return;
+
+    for (unsigned cpu = 0; cpu < num_stats_cpus; cpu++) {
+        int spl = splhigh();
+        bzero(&percpu_stats[cpu], sizeof(struct fstats));
+        splx(spl);
+    }
+}
+
+// Print the totals, for the kernel menu
+void fstats_print() {
+    struct fstats *total = kmalloc(sizeof(struct fstats));
+    if (total == NULL) {
+        kprintf("fstats: out of memory\n");
+        return;
+    }
+    fstats_snapshot(total);
+
+    for (int i = 0; i < FSTATS_NSYSCALLS; i++) {
+        struct fstats_syscall *stats = &total->sys[i];
+        if (stats->calls == 0) continue;
+
+        kprintf("%-6s %llu calls, %llu bytes, avg %llu ns\n", syscall_names[i],
+                (unsigned long long)stats->calls, (unsigned long long)stats->bytes,
+                (unsigned long long)(stats->total_ns / stats->calls));
+
+        for (int e = 1; e < FSTATS_NERRNO; e++) {
+            if (stats->errors[e] != 0) {
+                kprintf("       errno %d: %u\n", e, stats->errors[e]);
+            }
+        }
+
+        for (int b = 0; b < FSTATS_NBUCKETS; b++) {
+            if (stats->latency[b] == 0) continue;
+            if (b == 0) {
+                kprintf("       < 1024 ns: %u\n", stats->latency[b]);
+            } else {
+                kprintf("       >= %u ns: %u\n", 1u << (9 + b), stats->latency[b]);
+            }
+        }
+    }
+
+    if (total->mutex_acquires != 0) {
+        kprintf("open_file mutex: %llu acquires, avg wait %llu ns\n",
+                (unsigned long long)total->mutex_acquires,
+                (unsigned long long)(total->mutex_wait_ns / total->mutex_acquires));
+    }
+
+    kfree(total);
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                   syscall function                 //
+////////////////////////////////////////////////////////
+
+// Copy the totals out to buf, optionally zeroing them afterwards
+int sys_fstats(userptr_t buf, int flags, int *errno) {
+    if ((flags & ~FSTATS_RESET) != 0) {
+        *errno = EINVAL;
+        return -1;
+    }
+
+    struct fstats *total = kmalloc(sizeof(struct fstats));
+    if (total == NULL) {
+        *errno = ENOMEM;
+        return -1;
+    }
+    fstats_snapshot(total);
+
+    *errno = copyout(total, buf, sizeof(struct fstats));
+    kfree(total);
+    if (*errno) {
+        return -1;
+    }
+
+    if (flags & FSTATS_RESET) {
+        fstats_reset();
+    }
+
+    return 0;
+}
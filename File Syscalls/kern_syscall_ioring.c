@@ -0,0 +1,397 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/ioring.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <file.h>
+#include <conbuf.h>
+#include <pipe.h>
+#include <ioring.h>
+
+/*
+ * Batched asynchronous I/O.
+ *
+ * A process registers a submission and completion ring in its own memory.
+ * One ioring_enter() call copies in every pending submission and can
+ * wait for any number of completions, so many operations cost one trap.
+ * Workers are threads of the owning process: they run the normal sys_*
+ * implementations against its FD_table and copy results straight into
+ * its address space while the process keeps computing.
+ *
+ * Operations are not ordered with respect to each other. Completions
+ * that find the completion ring full are held until the next
+ * ioring_enter() reports that the user has made room.
+ *
+ * Exit must not wait on a worker that may never return, so pipe waits
+ * of a worker give up with EINTR once its ring shuts down, and console
+ * reads, which cannot be interrupted, are not accepted at all.
+ */
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                  worker functions                  //
+////////////////////////////////////////////////////////
+
+// Return 1 if fd is open on the console
+static int is_console_fd(int fd) {
+    struct open_file_node *node = acquire_fd(curproc->FD_table, fd);
+    if (node == NULL) return 0;
+
+    int console = conbuf_is_console(node->open_file->vnode);
+    close_open_file(node);
+    return console;
+}
+
+// Execute one submission and fill in its completion
+static void ioring_execute(const struct ioring_sqe *sqe, struct ioring_cqe *cqe) {
+    int err = 0;
+    int64_t res = 0;
+
+    switch (sqe->opcode) {
+        case IORING_OP_NOP:
+            break;
+        case IORING_OP_READ:
+            if (is_console_fd(sqe->fd)) {
+                err = EINVAL;
+                break;
+            }
+            res = sys_read(sqe->fd, (userptr_t)sqe->buf, sqe->len, &err);
+            break;
+        case IORING_OP_WRITE:
+            res = sys_write(sqe->fd, (userptr_t)sqe->buf, sqe->len, &err);
+            break;
+        case IORING_OP_LSEEK:
+            res = sys_lseek(sqe->fd, sqe->pos, sqe->whence, &err);
+            break;
+        case IORING_OP_CLOSE:
+            res = sys_close(sqe->fd, &err);
+            break;
+        default:
+            err = EINVAL;
+            break;
+    }
+
+    cqe->user_data = sqe->user_data;
+    cqe->err = err;
+    cqe->res = err ? -1 : res;
+}
+
+/* Append a completion to the user's completion ring, waiting for room if
+ * it is full. Caller holds ring->lock.
+ */
+static int ioring_post(struct ioring *ring, const struct ioring_cqe *cqe) {
+    struct ioring_shared *shared = (struct ioring_shared *)ring->shared;
+    uint32_t cq_head;
+
+    while (1) {
+        int result = copyin((userptr_t)&shared->cq_head, &cq_head, sizeof(cq_head));
+        if (result) return result;
+
+        if (ring->cq_tail - cq_head < ring->entries) break;
+        if (ring->exiting) return EINTR;
+
+        cv_wait(ring->space_cv, ring->lock);
+    }
+
+    // Fill in the entry before publishing the new tail
+    userptr_t slot = (userptr_t)((struct ioring_cqe *)ring->cq + (ring->cq_tail & (ring->entries - 1)));
+    int result = copyout(cqe, slot, sizeof(struct ioring_cqe));
+    if (result) return result;
+
+    ring->cq_tail++;
+    return copyout(&ring->cq_tail, (userptr_t)&shared->cq_tail, sizeof(uint32_t));
+}
+
+static void ioring_worker(void *data, unsigned long slot) {
+    struct ioring *ring = data;
+
+    lock_acquire(ring->lock);
+    ring->workers[slot] = curthread;
+    while (1) {
+        while (ring->queue_head == ring->queue_tail && !ring->exiting) {
+            cv_wait(ring->work_cv, ring->lock);
+        }
+        if (ring->exiting) break;
+
+        // Take the oldest submission
+        struct ioring_sqe sqe = ring->queue[ring->queue_head & (ring->entries - 1)];
+        ring->queue_head++;
+        ring->inflight++;
+        lock_release(ring->lock);
+
+        struct ioring_cqe cqe;
+        ioring_execute(&sqe, &cqe);
+
+        lock_acquire(ring->lock);
+        if (ioring_post(ring, &cqe) != 0) {
+            ring->dropped++;
+        }
+        ring->inflight--;
+        cv_broadcast(ring->done_cv, ring->lock);
+    }
+    ring->workers[slot] = NULL;
+    lock_release(ring->lock);
+
+    // Leave the process before saying so, it is torn down once all workers have
+    proc_remthread(curthread);
+    int result = proc_addthread(kproc, curthread);
+    KASSERT(result == 0);
+
+    V(ring->exited);
+    thread_exit();
+}
+
+// Return the calling thread's slot in its process's ring, -1 if not a worker
+static int worker_slot(struct ioring *ring) {
+    for (int i = 0; i < IORING_NWORKERS; i++) {
+        if (ring->workers[i] == curthread) return i;
+    }
+    return -1;
+}
+
+static struct ioring *current_ring(void) {
+    if (curproc->FD_table == NULL) return NULL;
+    return curproc->FD_table->ioring;
+}
+
+/* Note that the calling thread may block on pipe, so a ring shutting
+ * down can wake it. Does nothing outside ring workers. Called without
+ * pipe->lock held.
+ */
+void ioring_wait_begin(struct pipe *pipe) {
+    struct ioring *ring = current_ring();
+    if (ring == NULL) return;
+
+    lock_acquire(ring->lock);
+    int slot = worker_slot(ring);
+    if (slot >= 0) ring->waiting[slot] = pipe;
+    lock_release(ring->lock);
+}
+
+void ioring_wait_end(void) {
+    struct ioring *ring = current_ring();
+    if (ring == NULL) return;
+
+    lock_acquire(ring->lock);
+    int slot = worker_slot(ring);
+    if (slot >= 0) ring->waiting[slot] = NULL;
+    lock_release(ring->lock);
+}
+
+/* Return 1 if the calling thread is a worker of a ring that is shutting
+ * down and must not block. Checked by pipe waits under pipe->lock.
+ */
+int ioring_cancelled(void) {
+    struct ioring *ring = current_ring();
+    return ring != NULL && ring->exiting && worker_slot(ring) >= 0;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                   ring functions                   //
+////////////////////////////////////////////////////////
+
+/* Stop the workers, abandoning queued submissions, and free the ring */
+void ioring_destroy(struct ioring *ring) {
+    if (ring == NULL) return;
+
+    lock_acquire(ring->lock);
+    ring->exiting = 1;
+    cv_broadcast(ring->work_cv, ring->lock);
+    cv_broadcast(ring->space_cv, ring->lock);
+
+    // Workers blocked on a pipe give up, anything else running may finish
+    for (int i = 0; i < IORING_NWORKERS; i++) {
+        if (ring->waiting[i] != NULL) {
+            pipe_wake(ring->waiting[i]);
+        }
+    }
+    lock_release(ring->lock);
+
+    for (int i = 0; i < ring->nworkers; i++) {
+        P(ring->exited);
+    }
+
+    sem_destroy(ring->exited);
+    cv_destroy(ring->space_cv);
+    cv_destroy(ring->done_cv);
+    cv_destroy(ring->work_cv);
+    lock_destroy(ring->lock);
+    kfree(ring->queue);
+    kfree(ring);
+}
+
+/* Create the kernel side of a ring at the user address and start its
+ * workers in the current process. NULL if out of memory.
+ */
+struct ioring *ioring_create(userptr_t shared, uint32_t entries) {
+    struct ioring *ring = kmalloc(sizeof(struct ioring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->shared = shared;
+    ring->sq = (userptr_t)((struct ioring_shared *)shared + 1);
+    ring->cq = (userptr_t)((struct ioring_sqe *)ring->sq + entries);
+    ring->entries = entries;
+    ring->queue_head = 0;
+    ring->queue_tail = 0;
+    ring->inflight = 0;
+    ring->cq_tail = 0;
+    ring->dropped = 0;
+    ring->nworkers = 0;
+    ring->exiting = 0;
+    for (int i = 0; i < IORING_NWORKERS; i++) {
+        ring->workers[i] = NULL;
+        ring->waiting[i] = NULL;
+    }
+
+    ring->queue = kmalloc(sizeof(struct ioring_sqe) * entries);
+    ring->lock = lock_create("ioring");
+    ring->work_cv = cv_create("ioring_work");
+    ring->done_cv = cv_create("ioring_done");
+    ring->space_cv = cv_create("ioring_space");
+    ring->exited = sem_create("ioring_exited", 0);
+    if (ring->queue == NULL || ring->lock == NULL || ring->work_cv == NULL ||
+        ring->done_cv == NULL || ring->space_cv == NULL || ring->exited == NULL) {
+        if (ring->exited != NULL) sem_destroy(ring->exited);
+        if (ring->space_cv != NULL) cv_destroy(ring->space_cv);
+        if (ring->done_cv != NULL) cv_destroy(ring->done_cv);
+        if (ring->work_cv != NULL) cv_destroy(ring->work_cv);
+        if (ring->lock != NULL) lock_destroy(ring->lock);
+        if (ring->queue != NULL) kfree(ring->queue);
+        kfree(ring);
+        return NULL;
+    }
+
+    for (int i = 0; i < IORING_NWORKERS; i++) {
+        if (thread_fork("ioring worker", curproc, ioring_worker, ring, i) != 0) {
+            ioring_destroy(ring);
+            return NULL;
+        }
+        ring->nworkers++;
+    }
+
+    return ring;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                   syscall function                 //
+////////////////////////////////////////////////////////
+
+/* Register the rings at shared, which must have room for the header and
+ * entries submission and completion entries.
+ */
+int sys_ioring_setup(userptr_t shared, unsigned entries, int *errno) {
+    // Entries needs to be a power of two so the indices can wrap
+    if (entries == 0 || entries > IORING_MAX_ENTRIES || (entries & (entries - 1)) != 0) {
+        *errno = EINVAL;
+        return -1;
+    }
+
+    // The ring's workers use this process's descriptors, it cannot share them
+    if ((*errno = FD_table_unshare(&curproc->FD_table)) != 0) {
+        return -1;
+    }
+    struct file_descriptor_table *FD_table = curproc->FD_table;
+
+    lock_acquire(FD_table->lock);
+
+    if (FD_table->ioring != NULL) {
+        lock_release(FD_table->lock);
+        *errno = EBUSY;
+        return -1;
+    }
+
+    // Start with both rings empty
+    struct ioring_shared header = { 0, 0, 0, 0, entries, 0 };
+    *errno = copyout(&header, shared, sizeof(header));
+    if (*errno) {
+        lock_release(FD_table->lock);
+        return -1;
+    }
+
+    if ((FD_table->ioring = ioring_create(shared, entries)) == NULL) {
+        lock_release(FD_table->lock);
+        *errno = ENOMEM;
+        return -1;
+    }
+
+    lock_release(FD_table->lock);
+
+    return 0;
+}
+
+/* Submit up to to_submit queued entries, then wait until at least
+ * min_complete completions are waiting to be reaped. Return the number
+ * of entries submitted.
+ */
+int sys_ioring_enter(unsigned to_submit, unsigned min_complete, int *errno) {
+    struct ioring *ring = curproc->FD_table->ioring;
+    if (ring == NULL || min_complete > ring->entries) {
+        *errno = EINVAL;
+        return -1;
+    }
+
+    struct ioring_shared *user = (struct ioring_shared *)ring->shared;
+    struct ioring_shared shared;
+    uint32_t mask = ring->entries - 1;
+    int submitted = 0;
+
+    lock_acquire(ring->lock);
+
+    *errno = copyin(ring->shared, &shared, sizeof(shared));
+    if (*errno) {
+        lock_release(ring->lock);
+        return -1;
+    }
+
+    // Copy submissions into the kernel queue while both have entries
+    uint32_t sq_head = shared.sq_head;
+    while ((unsigned)submitted < to_submit && sq_head != shared.sq_tail &&
+           ring->queue_tail - ring->queue_head < ring->entries) {
+        userptr_t sqe = (userptr_t)((struct ioring_sqe *)ring->sq + (sq_head & mask));
+        *errno = copyin(sqe, &ring->queue[ring->queue_tail & mask], sizeof(struct ioring_sqe));
+        if (*errno) break;
+
+        sq_head++;
+        ring->queue_tail++;
+        submitted++;
+    }
+
+    if (submitted > 0) {
+        copyout(&sq_head, (userptr_t)&user->sq_head, sizeof(uint32_t));
+        cv_broadcast(ring->work_cv, ring->lock);
+    }
+    if (*errno && submitted == 0) {
+        lock_release(ring->lock);
+        return -1;
+    }
+    *errno = 0;
+
+    // The user may have reaped completions since the last call
+    cv_broadcast(ring->space_cv, ring->lock);
+    copyout(&ring->dropped, (userptr_t)&user->cq_dropped, sizeof(uint32_t));
+
+    uint32_t cq_head;
+    while (1) {
+        if (copyin((userptr_t)&user->cq_head, &cq_head, sizeof(uint32_t)) != 0) break;
+
+        // A full completion ring also ends the wait, only the caller can drain it
+        if (ring->cq_tail - cq_head >= min_complete) break;
+
+        // Nothing left that could complete
+        if (ring->inflight == 0 && ring->queue_head == ring->queue_tail) break;
+
+        cv_wait(ring->done_cv, ring->lock);
+    }
+
+    lock_release(ring->lock);
+
+    return submitted;
+}
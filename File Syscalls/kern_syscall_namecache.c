@@ -0,0 +1,389 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/limits.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <namecache.h>
+
+/*
+ * Pathname lookup cache.
+ *
+ * sys_open resolves paths one component at a time here instead of
+ * handing the whole path to vfs_open. Each (directory, component) step
+ * is answered from the cache when possible, including negative answers
+ * for names that do not exist, and only misses go to VOP_LOOKUP.
+ *
+ * Entries are dropped by sys_remove and sys_rename, and negative entries
+ * are replaced when namecache_open creates the file. Each of these bumps
+ * a generation count, and a lookup that missed the cache only enters
+ * its answer if nothing changed while it ran unlocked. "." and ".." are
+ * never cached, so moving a directory cannot leave a stale parent link.
+ * Files created or removed by kernel code that calls the VFS directly
+ * are not seen.
+ */
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                   cache functions                  //
+////////////////////////////////////////////////////////
+
+static struct namecache_entry *buckets[NAMECACHE_BUCKETS];
+static struct namecache_entry lru;          // Sentinel of the LRU list
+static int num_entries = 0;
+static unsigned generation = 0;            // Bumped whenever a name is created or invalidated
+static struct lock *namecache_lock = NULL;
+
+void namecache_bootstrap() {
+    namecache_lock = lock_create("namecache_lock");
+    if (namecache_lock == NULL) {
+        panic("Insufficient memory for name cache\n");
+    }
+
+    for (int i = 0; i < NAMECACHE_BUCKETS; i++) {
+        buckets[i] = NULL;
+    }
+    lru.lru_prev = &lru;
+    lru.lru_next = &lru;
+}
+
+static unsigned namecache_hash(struct vnode *dir, const char *name) {
+    unsigned hash = (unsigned)(uintptr_t)dir >> 4;
+    for (; *name != '\0'; name++) {
+        hash = hash * 31 + (unsigned char)*name;
+    }
+    return hash & (NAMECACHE_BUCKETS - 1);
+}
+
+static void lru_unlink(struct namecache_entry *entry) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void lru_push_front(struct namecache_entry *entry) {
+    entry->lru_next = lru.lru_next;
+    entry->lru_prev = &lru;
+    lru.lru_next->lru_prev = entry;
+    lru.lru_next = entry;
+}
+
+// Return the entry for (dir, name), NULL on a miss. Caller holds namecache_lock
+static struct namecache_entry **find_entry(struct vnode *dir, const char *name) {
+    struct namecache_entry **curr = &buckets[namecache_hash(dir, name)];
+    while (*curr != NULL) {
+        if ((*curr)->dir == dir && strcmp((*curr)->name, name) == 0) break;
+        curr = &(*curr)->hash_next;
+    }
+    return curr;
+}
+
+// Unlink and free the entry at *link, caller holds namecache_lock
+static void remove_entry(struct namecache_entry **link) {
+    struct namecache_entry *entry = *link;
+    *link = entry->hash_next;
+    lru_unlink(entry);
+    num_entries--;
+
+    VOP_DECREF(entry->dir);
+    if (entry->child != NULL) VOP_DECREF(entry->child);
+    kfree(entry);
+}
+
+/* Look up (dir, name): 1 and a referenced child on a hit, 0 and the
+ * current generation in gen on a miss, -1 if the name is cached as not
+ * existing.
+ */
+static int cache_lookup(struct vnode *dir, const char *name, struct vnode **child, unsigned *gen) {
+    if (strlen(name) > NAMECACHE_NAMELEN) return 0;
+
+    lock_acquire(namecache_lock);
+
+    struct namecache_entry *entry = *find_entry(dir, name);
+    if (entry == NULL) {
+        *gen = generation;
+        lock_release(namecache_lock);
+        return 0;
+    }
+
+    lru_unlink(entry);
+    lru_push_front(entry);
+
+    int result = -1;
+    if (entry->child != NULL) {
+        VOP_INCREF(entry->child);
+        *child = entry->child;
+        result = 1;
+    }
+
+    lock_release(namecache_lock);
+    return result;
+}
+
+/* Record that (dir, name) resolves to child, NULL meaning it does not
+ * exist. Caller holds namecache_lock.
+ */
+static void enter_locked(struct vnode *dir, const char *name, struct vnode *child) {
+    // Replace what is cached for the name
+    struct namecache_entry **link = find_entry(dir, name);
+    if (*link != NULL) {
+        remove_entry(link);
+    }
+
+    // Make room by evicting the least recently used entry
+    if (num_entries >= NAMECACHE_MAX) {
+        struct namecache_entry *victim = lru.lru_prev;
+        remove_entry(find_entry(victim->dir, victim->name));
+    }
+
+    struct namecache_entry *entry = kmalloc(sizeof(struct namecache_entry));
+    if (entry == NULL) return;
+
+    VOP_INCREF(dir);
+    if (child != NULL) VOP_INCREF(child);
+    entry->dir = dir;
+    entry->child = child;
+    strcpy(entry->name, name);
+
+    link = &buckets[namecache_hash(dir, name)];
+    entry->hash_next = *link;
+    *link = entry;
+    lru_push_front(entry);
+    num_entries++;
+}
+
+/* Record the answer of a lookup that started at generation gen, unless
+ * a name was created or invalidated since and the answer may be stale.
+ */
+static void cache_enter(struct vnode *dir, const char *name, struct vnode *child, unsigned gen) {
+    if (strlen(name) > NAMECACHE_NAMELEN) return;
+
+    lock_acquire(namecache_lock);
+    if (gen == generation) {
+        enter_locked(dir, name, child);
+    }
+    lock_release(namecache_lock);
+}
+
+// Record a file just created as (dir, name), replacing any negative entry
+static void cache_create(struct vnode *dir, const char *name, struct vnode *child) {
+    if (strlen(name) > NAMECACHE_NAMELEN) return;
+
+    lock_acquire(namecache_lock);
+    generation++;
+    enter_locked(dir, name, child);
+    lock_release(namecache_lock);
+}
+
+// Forget whatever is cached for (dir, name)
+void namecache_invalidate(struct vnode *dir, const char *name) {
+    lock_acquire(namecache_lock);
+    generation++;
+
+    struct namecache_entry **link = find_entry(dir, name);
+    if (*link != NULL) {
+        remove_entry(link);
+    }
+
+    lock_release(namecache_lock);
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 path walk functions                //
+////////////////////////////////////////////////////////
+
+/* Find the vnode a path starts from: the named device for "dev:...",
+ * the root for "/...", otherwise the current directory. Return the
+ * referenced vnode and point rest at the remaining components.
+ */
+static int walk_start(const char *path, struct vnode **start, const char **rest) {
+    char prefix[__NAME_MAX + 2];
+    const char *colon = strchr(path, ':');
+
+    if (colon == NULL && path[0] != '/') {
+        *rest = path;
+        return vfs_getcurdir(start);
+    }
+
+    size_t len = colon != NULL ? (size_t)(colon - path) + 1 : 1;
+    if (len > __NAME_MAX + 1) return ENAMETOOLONG;
+
+    // vfs_lookup resolves a bare device or "/" without walking anything
+    memcpy(prefix, path, len);
+    prefix[len] = '\0';
+    *rest = path + len;
+    return vfs_lookup(prefix, start);
+}
+
+/* Copy the next component of *rest into name and advance *rest past it.
+ * Return 0 at the end of the path.
+ */
+static int next_component(const char **rest, char *name, size_t namelen, int *result) {
+    const char *p = *rest;
+    while (*p == '/') p++;
+    if (*p == '\0') {
+        *rest = p;
+        return 0;
+    }
+
+    size_t len = 0;
+    while (p[len] != '/' && p[len] != '\0') len++;
+    if (len >= namelen) {
+        *result = ENAMETOOLONG;
+        return 0;
+    }
+
+    memcpy(name, p, len);
+    name[len] = '\0';
+    *rest = p + len;
+    return 1;
+}
+
+// Resolve one component of dir, through the cache unless it is "." or ".."
+static int lookup_component(struct vnode *dir, char *name, struct vnode **child) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return VOP_LOOKUP(dir, name, child);
+    }
+
+    unsigned gen = 0;
+    int hit = cache_lookup(dir, name, child, &gen);
+    if (hit == 1) return 0;
+    if (hit == -1) return ENOENT;
+
+    int result = VOP_LOOKUP(dir, name, child);
+    if (result == 0) {
+        cache_enter(dir, name, *child, gen);
+    } else if (result == ENOENT) {
+        cache_enter(dir, name, NULL, gen);
+    }
+    return result;
+}
+
+/* Walk the path. If buf is not NULL stop before the last component,
+ * copy it into buf and return the referenced parent; otherwise return
+ * the referenced vnode the whole path names.
+ */
+static int walk_path(char *path, struct vnode **ret, char *buf, size_t buflen) {
+    struct vnode *dir;
+    const char *rest;
+    int result = walk_start(path, &dir, &rest);
+    if (result) return result;
+
+    // Too big for the kernel stack under the path buffers of the callers
+    char *name = kmalloc(__NAME_MAX + 1);
+    if (name == NULL) {
+        VOP_DECREF(dir);
+        return ENOMEM;
+    }
+
+    name[0] = '\0';
+    result = 0;
+    while (next_component(&rest, name, __NAME_MAX + 1, &result)) {
+        // The last component belongs to the caller when looking up a parent
+        if (buf != NULL) {
+            const char *p = rest;
+            while (*p == '/') p++;
+            if (*p == '\0') break;
+        }
+
+        struct vnode *child;
+        result = lookup_component(dir, name, &child);
+        VOP_DECREF(dir);
+        if (result) {
+            kfree(name);
+            return result;
+        }
+        dir = child;
+    }
+
+    if (result == 0 && buf != NULL) {
+        // A path with no last component ("/", "dev:") has no parent to return
+        if (name[0] == '\0' || strlen(name) >= buflen) {
+            result = EINVAL;
+        } else {
+            strcpy(buf, name);
+        }
+    }
+    kfree(name);
+
+    if (result) {
+        VOP_DECREF(dir);
+        return result;
+    }
+
+    *ret = dir;
+    return 0;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 interface functions                //
+////////////////////////////////////////////////////////
+
+/* Same as vfs_lookparent but resolved through the cache: return the
+ * referenced directory holding the last component, copied into buf.
+ */
+int namecache_lookparent(char *path, struct vnode **ret, char *buf, size_t buflen) {
+    if (path[0] == '\0') return EINVAL;
+
+    buf[0] = '\0';
+    return walk_path(path, ret, buf, buflen);
+}
+
+/* Same as vfs_open but resolved through the cache. O_TRUNC is checked
+ * but the truncation is left to the caller, which has to write back
+ * buffered blocks of the file first.
+ */
+int namecache_open(char *path, int openflags, mode_t mode, struct vnode **ret) {
+    int canwrite;
+    switch (openflags & O_ACCMODE) {
+        case O_RDONLY:
+            canwrite = 0;
+            break;
+        case O_WRONLY:
+        case O_RDWR:
+            canwrite = 1;
+            break;
+        default:
+            return EINVAL;
+    }
+
+    if (path[0] == '\0') return EINVAL;
+
+    struct vnode *vn = NULL;
+    int result;
+    if (openflags & O_CREAT) {
+        char *name = kmalloc(__NAME_MAX + 1);
+        if (name == NULL) return ENOMEM;
+
+        struct vnode *dir;
+        result = namecache_lookparent(path, &dir, name, __NAME_MAX + 1);
+        if (result == 0) {
+            result = VOP_CREAT(dir, name, (openflags & O_EXCL) != 0, mode, &vn);
+            if (result == 0) {
+                cache_create(dir, name, vn);
+            }
+            VOP_DECREF(dir);
+        }
+        kfree(name);
+    } else {
+        result = walk_path(path, &vn, NULL, 0);
+    }
+    if (result) return result;
+
+    result = VOP_EACHOPEN(vn, openflags);
+    if (result) {
+        VOP_DECREF(vn);
+        return result;
+    }
+
+    if ((openflags & O_TRUNC) && !canwrite) {
+        VOP_DECREF(vn);
+        return EINVAL;
+    }
+
+    *ret = vn;
+    return 0;
+}
@@ -0,0 +1,324 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <current.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <vm.h>
+#include <file.h>
+#include <pipe.h>
+#include <ioring.h>
+
+/*
+ * Pipes.
+ *
+ * A pipe is a ring of up to PIPE_NPAGES whole pages shared by a read and
+ * a write open file. Writes of a page or more fill a page of their own
+ * without holding the pipe lock and hand it to the ring in one step;
+ * the reader takes a page off the ring the same way when it wants all
+ * of it. Short writes are appended to the last page in place.
+ *
+ * Writers are serialised by the write end's open file mutex and readers
+ * by the read end's, so only the two ends race on the ring.
+ */
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 page ring functions                //
+////////////////////////////////////////////////////////
+
+// Return an empty page, reusing a spare one if possible. Caller holds pipe->lock
+static vaddr_t get_page(struct pipe *pipe) {
+    if (pipe->nspare > 0) {
+        return pipe->spare[--pipe->nspare];
+    }
+    return alloc_kpages(1);
+}
+
+// Keep the page for reuse, free it if enough are spare. Caller holds pipe->lock
+static void put_page(struct pipe *pipe, vaddr_t kva) {
+    if (pipe->nspare < PIPE_NPAGES) {
+        pipe->spare[pipe->nspare++] = kva;
+    } else {
+        free_kpages(kva);
+    }
+}
+
+// The newest page in the ring, NULL if empty
+static struct pipe_page *tail_page(struct pipe *pipe) {
+    if (pipe->npages == 0) return NULL;
+    return &pipe->ring[(pipe->head + pipe->npages - 1) % PIPE_NPAGES];
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 interface functions                //
+////////////////////////////////////////////////////////
+
+// Create a pipe with both ends open
+struct pipe *pipe_create() {
+    struct pipe *pipe = kmalloc(sizeof(struct pipe));
+    if (pipe == NULL) {
+        return NULL;
+    }
+
+    pipe->lock = lock_create("pipe_lock");
+    pipe->readable = cv_create("pipe_readable");
+    pipe->writable = cv_create("pipe_writable");
+    if (pipe->lock == NULL || pipe->readable == NULL || pipe->writable == NULL) {
+        if (pipe->lock != NULL) lock_destroy(pipe->lock);
+        if (pipe->readable != NULL) cv_destroy(pipe->readable);
+        if (pipe->writable != NULL) cv_destroy(pipe->writable);
+        kfree(pipe);
+        return NULL;
+    }
+
+    pipe->head = 0;
+    pipe->npages = 0;
+    pipe->nspare = 0;
+    pipe->read_open = 1;
+    pipe->write_open = 1;
+
+    return pipe;
+}
+
+/* Read what is available into uio, waiting for data if the pipe is
+ * empty. Returns with nothing read once the write end is closed, EINTR
+ * if an ioring worker's ring shuts down while it waits.
+ */
+int pipe_read(struct pipe *pipe, struct uio *uio) {
+    int result = 0;
+
+    ioring_wait_begin(pipe);
+    lock_acquire(pipe->lock);
+
+    while (pipe->npages == 0 && pipe->write_open) {
+        if (ioring_cancelled()) {
+            result = EINTR;
+            break;
+        }
+        cv_wait(pipe->readable, pipe->lock);
+    }
+
+    while (uio->uio_resid > 0 && pipe->npages > 0) {
+        struct pipe_page *page = &pipe->ring[pipe->head];
+        unsigned len = page->end - page->start;
+
+        if (uio->uio_resid >= len && page->end == PAGE_SIZE) {
+            // Take the whole page and copy it out without the lock
+            struct pipe_page taken = *page;
+            pipe->head = (pipe->head + 1) % PIPE_NPAGES;
+            pipe->npages--;
+            cv_signal(pipe->writable, pipe->lock);
+            lock_release(pipe->lock);
+
+            result = uiomove((void *)(taken.kva + taken.start), len, uio);
+
+            lock_acquire(pipe->lock);
+            put_page(pipe, taken.kva);
+            if (result) break;
+        } else {
+            // Part of a page, or a page the writer may still append to
+            if (len > uio->uio_resid) len = uio->uio_resid;
+            result = uiomove((void *)(page->kva + page->start), len, uio);
+            if (result) break;
+
+            page->start += len;
+            if (page->start == page->end) {
+                put_page(pipe, page->kva);
+                pipe->head = (pipe->head + 1) % PIPE_NPAGES;
+                pipe->npages--;
+                cv_signal(pipe->writable, pipe->lock);
+            }
+        }
+    }
+
+    lock_release(pipe->lock);
+    ioring_wait_end();
+
+    return result;
+}
+
+/* Write all of uio, waiting for room as needed. EPIPE once the read
+ * end is closed and EINTR if an ioring worker's ring shuts down, uio
+ * then shows how much was written.
+ */
+int pipe_write(struct pipe *pipe, struct uio *uio) {
+    int result = 0;
+
+    ioring_wait_begin(pipe);
+    lock_acquire(pipe->lock);
+
+    while (uio->uio_resid > 0) {
+        if (!pipe->read_open) {
+            result = EPIPE;
+            break;
+        }
+
+        // Short writes go to the end of the last page if they fit
+        struct pipe_page *tail = tail_page(pipe);
+        if (uio->uio_resid < PAGE_SIZE && tail != NULL && PAGE_SIZE - tail->end >= uio->uio_resid) {
+            unsigned len = uio->uio_resid;
+            result = uiomove((void *)(tail->kva + tail->end), len, uio);
+            if (result) break;
+
+            tail->end += len;
+            cv_signal(pipe->readable, pipe->lock);
+            continue;
+        }
+
+        if (pipe->npages == PIPE_NPAGES) {
+            if (ioring_cancelled()) {
+                result = EINTR;
+                break;
+            }
+            cv_wait(pipe->writable, pipe->lock);
+            continue;
+        }
+
+        // Fill a fresh page without the lock, then hand it to the reader
+        vaddr_t kva = get_page(pipe);
+        if (kva == 0) {
+            result = ENOMEM;
+            break;
+        }
+        lock_release(pipe->lock);
+
+        unsigned len = uio->uio_resid < PAGE_SIZE ? uio->uio_resid : PAGE_SIZE;
+        result = uiomove((void *)kva, len, uio);
+
+        lock_acquire(pipe->lock);
+        if (result) {
+            put_page(pipe, kva);
+            break;
+        }
+
+        // Only this writer adds pages, so the slot is still free
+        KASSERT(pipe->npages < PIPE_NPAGES);
+        struct pipe_page *page = &pipe->ring[(pipe->head + pipe->npages) % PIPE_NPAGES];
+        page->kva = kva;
+        page->start = 0;
+        page->end = len;
+        pipe->npages++;
+        cv_signal(pipe->readable, pipe->lock);
+    }
+
+    lock_release(pipe->lock);
+    ioring_wait_end();
+
+    return result;
+}
+
+// Wake every reader and writer so they recheck whether to keep waiting
+void pipe_wake(struct pipe *pipe) {
+    lock_acquire(pipe->lock);
+    cv_broadcast(pipe->readable, pipe->lock);
+    cv_broadcast(pipe->writable, pipe->lock);
+    lock_release(pipe->lock);
+}
+
+// Close one end, the pipe is freed with the second
+void pipe_close(struct pipe *pipe, int write_end) {
+    lock_acquire(pipe->lock);
+
+    if (write_end) {
+        pipe->write_open = 0;
+        cv_broadcast(pipe->readable, pipe->lock);
+    } else {
+        pipe->read_open = 0;
+        cv_broadcast(pipe->writable, pipe->lock);
+    }
+
+    int last = !pipe->read_open && !pipe->write_open;
+    lock_release(pipe->lock);
+
+    if (!last) return;
+
+    for (unsigned i = 0; i < pipe->npages; i++) {
+        free_kpages(pipe->ring[(pipe->head + i) % PIPE_NPAGES].kva);
+    }
+    for (unsigned i = 0; i < pipe->nspare; i++) {
+        free_kpages(pipe->spare[i]);
+    }
+    cv_destroy(pipe->readable);
+    cv_destroy(pipe->writable);
+    lock_destroy(pipe->lock);
+    kfree(pipe);
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                   syscall function                 //
+////////////////////////////////////////////////////////
+
+// Wrap one end of the pipe in an open file node
+static struct open_file_node *open_pipe_end(struct pipe *pipe, int flags) {
+    struct open_file *file = create_open_file();
+    if (file == NULL) {
+        return NULL;
+    }
+    file->pipe = pipe;
+    file->flags = flags;
+
+    return add_open_file(file);
+}
+
+/* Create a pipe and store its read and write fds in fds[0] and fds[1].
+ */
+int sys_pipe(userptr_t fds, int *errno) {
+    struct pipe *pipe = pipe_create();
+    if (pipe == NULL) {
+        *errno = ENOMEM;
+        return -1;
+    }
+
+    // Each end closes its side of the pipe once freed
+    struct open_file_node *read_node = open_pipe_end(pipe, O_RDONLY);
+    if (read_node == NULL) {
+        pipe_close(pipe, 0);
+        pipe_close(pipe, 1);
+        *errno = ENOMEM;
+        return -1;
+    }
+    struct open_file_node *write_node = open_pipe_end(pipe, O_WRONLY);
+    if (write_node == NULL) {
+        close_open_file(read_node);
+        pipe_close(pipe, 1);
+        *errno = ENOMEM;
+        return -1;
+    }
+
+    // Taking fds changes the table, stop sharing it first
+    if ((*errno = FD_table_unshare(&curproc->FD_table)) != 0) {
+        close_open_file(read_node);
+        close_open_file(write_node);
+        return -1;
+    }
+    struct file_descriptor_table *FD_table = curproc->FD_table;
+
+    int pipefds[2];
+    if ((pipefds[0] = install_fd(FD_table, read_node)) == -1) {
+        close_open_file(read_node);
+        close_open_file(write_node);
+        *errno = EMFILE;
+        return -1;
+    }
+    if ((pipefds[1] = install_fd(FD_table, write_node)) == -1) {
+        close_fd(FD_table, pipefds[0]);
+        close_open_file(write_node);
+        *errno = EMFILE;
+        return -1;
+    }
+
+    *errno = copyout(pipefds, fds, sizeof(pipefds));
+    if (*errno) {
+        close_fd(FD_table, pipefds[0]);
+        close_fd(FD_table, pipefds[1]);
+        return -1;
+    }
+
+    return 0;
+}
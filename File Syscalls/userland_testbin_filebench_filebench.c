@@ -0,0 +1,379 @@
+/*
+ * filebench - benchmarks for the file syscalls.
+ *
+ * Sweeps read/write buffer sizes with sequential and random offsets,
+ * times lseek, and runs 1, 2 and 4 processes writing either through one
+ * shared descriptor or through descriptors of their own. Churn tests
+ * open and close files (deep paths and full descriptor tables) and dup2
+ * descriptors. It also compares copy_file_range with a read/write loop,
+ * O_DIRECT with buffered transfers, and times pipes across message sizes.
+ *
+ * Usage: filebench [-r runs] [-b baseline] [-s baseline] [-t pct] [benchmark...]
+ * Output and baseline format are described in bench.h. The exit status
+ * is the number of benchmarks slower than the baseline.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <bench.h>
+
+/* System calls added by this tree, stubs are generated from kern/syscall.h */
+ssize_t copy_file_range(int infd, int outfd, size_t len);
+
+/* Transfers between the device and user pages, as in the kernel's file.h */
+#ifndef O_DIRECT
+#define O_DIRECT 128
+#endif
+
+#define FB_FILE         "fbench.dat"
+#define FB_COPY         "fbench.cpy"
+#define FB_FILE_BYTES   (256 * 1024)
+#define FB_MAX_BUF      (64 * 1024)
+#define FB_RANDOM_OPS   256
+#define FB_LSEEKS       1024
+#define FB_SHARE_CHUNKS 128             /* 512 byte writes by each process */
+#define FB_CHURN        256             /* open/close or dup2/close pairs per run */
+#define FB_DEPTH        8               /* Directories above the deep file */
+#define FB_OPEN_FDS     60              /* Descriptors held open at once */
+#define FB_PIPE_BYTES   (128 * 1024)
+
+static char buf[FB_MAX_BUF] __attribute__((aligned(4096)));
+
+/* Parameters of one benchmark */
+struct fb_case {
+    size_t  size;       /* Bytes per transfer */
+    int     procs;      /* Concurrent processes */
+    int     flags;      /* Extra open flags */
+};
+
+static int open_file(const char *path, int flags) {
+    int fd = open(path, flags, 0664);
+    if (fd < 0) err(1, "%s", path);
+    return fd;
+}
+
+static void wait_child(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) < 0) err(1, "waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) errx(1, "child %d failed", pid);
+}
+
+// Write the whole benchmark file so reads have something to read
+static void fill_file(void) {
+    int fd = open_file(FB_FILE, O_WRONLY | O_CREAT | O_TRUNC);
+    memset(buf, 'f', sizeof(buf));
+    for (size_t done = 0; done < FB_FILE_BYTES; done += FB_MAX_BUF) {
+        if (write(fd, buf, FB_MAX_BUF) != FB_MAX_BUF) err(1, "write");
+    }
+    close(fd);
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 read, write, lseek                 //
+////////////////////////////////////////////////////////
+
+static uint64_t write_seq(void *arg) {
+    struct fb_case *c = arg;
+    int fd = open_file(FB_FILE, O_WRONLY | c->flags);
+
+    uint64_t start = bench_now();
+    for (size_t done = 0; done < FB_FILE_BYTES; done += c->size) {
+        if (write(fd, buf, c->size) != (ssize_t)c->size) err(1, "write");
+    }
+    if (fsync(fd) < 0) err(1, "fsync");     // Count write-back, for comparison with O_DIRECT
+    uint64_t elapsed = bench_now() - start;
+
+    close(fd);
+    return elapsed;
+}
+
+static uint64_t read_seq(void *arg) {
+    struct fb_case *c = arg;
+    int fd = open_file(FB_FILE, O_RDONLY | c->flags);
+
+    uint64_t start = bench_now();
+    for (size_t done = 0; done < FB_FILE_BYTES; done += c->size) {
+        if (read(fd, buf, c->size) != (ssize_t)c->size) err(1, "read");
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    close(fd);
+    return elapsed;
+}
+
+static uint64_t read_rand(void *arg) {
+    struct fb_case *c = arg;
+    int fd = open_file(FB_FILE, O_RDONLY);
+    unsigned blocks = FB_FILE_BYTES / c->size;
+
+    srandom(1);
+    uint64_t start = bench_now();
+    for (int i = 0; i < FB_RANDOM_OPS; i++) {
+        if (lseek(fd, (off_t)(random() % blocks) * c->size, SEEK_SET) < 0) err(1, "lseek");
+        if (read(fd, buf, c->size) != (ssize_t)c->size) err(1, "read");
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    close(fd);
+    return elapsed;
+}
+
+static uint64_t lseek_mix(void *arg) {
+    (void)arg;
+    int fd = open_file(FB_FILE, O_RDONLY);
+    static const int whence[3] = { SEEK_SET, SEEK_CUR, SEEK_END };
+
+    uint64_t start = bench_now();
+    for (int i = 0; i < FB_LSEEKS; i++) {
+        if (lseek(fd, 0, whence[i % 3]) < 0) err(1, "lseek");
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    close(fd);
+    return elapsed;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                   concurrency                      //
+////////////////////////////////////////////////////////
+
+/* procs processes write FB_SHARE_CHUNKS blocks each, through the one
+ * descriptor opened before fork (shared open file and offset) if shared,
+ * else through their own descriptor at their own part of the file.
+ */
+static uint64_t concurrent_writes(int procs, int shared) {
+    pid_t pids[4];
+    int fd = shared ? open_file(FB_FILE, O_WRONLY) : -1;
+
+    uint64_t start = bench_now();
+    for (int p = 0; p < procs; p++) {
+        if ((pids[p] = fork()) < 0) err(1, "fork");
+        if (pids[p] != 0) continue;
+
+        int myfd = fd;
+        if (!shared) {
+            myfd = open_file(FB_FILE, O_WRONLY);
+            if (lseek(myfd, (off_t)p * FB_SHARE_CHUNKS * 512, SEEK_SET) < 0) _exit(1);
+        }
+        for (int i = 0; i < FB_SHARE_CHUNKS; i++) {
+            if (write(myfd, buf, 512) != 512) _exit(1);
+        }
+        _exit(0);
+    }
+    for (int p = 0; p < procs; p++) wait_child(pids[p]);
+    uint64_t elapsed = bench_now() - start;
+
+    if (shared) close(fd);
+    return elapsed;
+}
+
+static uint64_t share_fd(void *arg) {
+    return concurrent_writes(((struct fb_case *)arg)->procs, 1);
+}
+
+static uint64_t share_file(void *arg) {
+    return concurrent_writes(((struct fb_case *)arg)->procs, 0);
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                  descriptor churn                  //
+////////////////////////////////////////////////////////
+
+static char deep_path[FB_DEPTH * 2 + sizeof(FB_FILE)];
+
+static uint64_t open_close(void *arg) {
+    const char *path = arg;
+
+    uint64_t start = bench_now();
+    for (int i = 0; i < FB_CHURN; i++) {
+        close(open_file(path, O_RDONLY));
+    }
+    return bench_now() - start;
+}
+
+// Fill the descriptor table, then empty it
+static uint64_t open_many(void *arg) {
+    (void)arg;
+    int fds[FB_OPEN_FDS];
+
+    uint64_t start = bench_now();
+    for (int i = 0; i < FB_OPEN_FDS; i++) fds[i] = open_file(FB_FILE, O_RDONLY);
+    for (int i = 0; i < FB_OPEN_FDS; i++) close(fds[i]);
+    return bench_now() - start;
+}
+
+static uint64_t dup2_churn(void *arg) {
+    (void)arg;
+    int fd = open_file(FB_FILE, O_RDONLY);
+
+    uint64_t start = bench_now();
+    for (int i = 0; i < FB_CHURN; i++) {
+        int newfd = 10 + i % 32;
+        if (dup2(fd, newfd) != newfd) err(1, "dup2");
+        close(newfd);
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    close(fd);
+    return elapsed;
+}
+
+// Build d/d/.../fbench.dat, 0 if directories cannot be made
+static int make_deep_path(void) {
+    size_t len = 0;
+    for (int i = 0; i < FB_DEPTH; i++) {
+        deep_path[len++] = 'd';
+        deep_path[len] = '\0';
+        if (mkdir(deep_path, 0775) < 0) {
+            // Left over from an earlier run
+            int fd = open(deep_path, O_RDONLY);
+            if (fd < 0) return 0;
+            close(fd);
+        }
+        deep_path[len++] = '/';
+    }
+    strcpy(&deep_path[len], FB_FILE);
+    close(open_file(deep_path, O_WRONLY | O_CREAT));
+    return 1;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 copies and pipes                   //
+////////////////////////////////////////////////////////
+
+// the file copied in copy_file_range calls of at most size bytes
+static uint64_t copy_range(void *arg) {
+    struct fb_case *c = arg;
+    int in = open_file(FB_FILE, O_RDONLY);
+    int out = open_file(FB_COPY, O_WRONLY | O_CREAT | O_TRUNC);
+
+    uint64_t start = bench_now();
+    size_t done = 0;
+    while (done < FB_FILE_BYTES) {
+        size_t len = FB_FILE_BYTES - done < c->size ? FB_FILE_BYTES - done : c->size;
+        ssize_t n = copy_file_range(in, out, len);
+        if (n <= 0) err(1, "copy_file_range");
+        done += n;
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    close(in);
+    close(out);
+    return elapsed;
+}
+
+// the same copy through read and write of size bytes
+static uint64_t copy_loop(void *arg) {
+    struct fb_case *c = arg;
+    int in = open_file(FB_FILE, O_RDONLY);
+    int out = open_file(FB_COPY, O_WRONLY | O_CREAT | O_TRUNC);
+
+    uint64_t start = bench_now();
+    ssize_t n;
+    while ((n = read(in, buf, c->size)) > 0) {
+        if (write(out, buf, n) != n) err(1, "write");
+    }
+    if (n < 0) err(1, "read");
+    uint64_t elapsed = bench_now() - start;
+
+    close(in);
+    close(out);
+    return elapsed;
+}
+
+// FB_PIPE_BYTES through a pipe to a child in size messages
+static uint64_t pipe_stream(void *arg) {
+    struct fb_case *c = arg;
+    int fds[2];
+    if (pipe(fds) < 0) err(1, "pipe");
+
+    uint64_t start = bench_now();
+    pid_t pid = fork();
+    if (pid < 0) err(1, "fork");
+    if (pid == 0) {
+        close(fds[1]);
+        size_t got = 0;
+        ssize_t n;
+        while ((n = read(fds[0], buf, c->size)) > 0) got += n;
+        _exit(got == FB_PIPE_BYTES ? 0 : 1);
+    }
+
+    close(fds[0]);
+    for (size_t done = 0; done < FB_PIPE_BYTES; done += c->size) {
+        if (write(fds[1], buf, c->size) != (ssize_t)c->size) err(1, "pipe write");
+    }
+    close(fds[1]);
+    wait_child(pid);
+    return bench_now() - start;
+}
+
+int main(int argc, char **argv) {
+    char name[BENCH_NAME_MAX];
+    static const size_t sizes[] = { 64, 512, 4096, 16384 };
+    static const int procs[] = { 1, 2, 4 };
+
+    bench_init("filebench", argc, argv);
+    fill_file();
+
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        struct fb_case c = { sizes[i], 1, 0 };
+        snprintf(name, sizeof(name), "write_seq_%u", sizes[i]);
+        bench_run(name, FB_FILE_BYTES / sizes[i], write_seq, &c);
+        snprintf(name, sizeof(name), "read_seq_%u", sizes[i]);
+        bench_run(name, FB_FILE_BYTES / sizes[i], read_seq, &c);
+        snprintf(name, sizeof(name), "read_rand_%u", sizes[i]);
+        bench_run(name, FB_RANDOM_OPS, read_rand, &c);
+    }
+    bench_run("lseek", FB_LSEEKS, lseek_mix, NULL);
+
+    for (unsigned i = 0; i < sizeof(procs) / sizeof(procs[0]); i++) {
+        struct fb_case c = { 512, procs[i], 0 };
+        snprintf(name, sizeof(name), "share_fd_%d", procs[i]);
+        bench_run(name, FB_SHARE_CHUNKS * procs[i], share_fd, &c);
+        snprintf(name, sizeof(name), "share_file_%d", procs[i]);
+        bench_run(name, FB_SHARE_CHUNKS * procs[i], share_file, &c);
+    }
+
+    bench_run("open_close", FB_CHURN, open_close, (void *)FB_FILE);
+    if (bench_selected("open_close_deep")) {
+        if (make_deep_path()) bench_run("open_close_deep", FB_CHURN, open_close, deep_path);
+        else warnx("open_close_deep: cannot make directories, skipped");
+    }
+    bench_run("open_many", FB_OPEN_FDS, open_many, NULL);
+    bench_run("dup2", FB_CHURN, dup2_churn, NULL);
+
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        struct fb_case c = { sizes[i], 1, 0 };
+        snprintf(name, sizeof(name), "copy_range_%u", sizes[i]);
+        bench_run(name, FB_FILE_BYTES / sizes[i], copy_range, &c);
+        snprintf(name, sizeof(name), "copy_loop_%u", sizes[i]);
+        bench_run(name, FB_FILE_BYTES / sizes[i], copy_loop, &c);
+    }
+
+    struct fb_case buffered = { FB_MAX_BUF, 1, 0 };
+    struct fb_case direct = { FB_MAX_BUF, 1, O_DIRECT };
+    bench_run("write_buffered", FB_FILE_BYTES / FB_MAX_BUF, write_seq, &buffered);
+    bench_run("write_direct", FB_FILE_BYTES / FB_MAX_BUF, write_seq, &direct);
+    bench_run("read_buffered", FB_FILE_BYTES / FB_MAX_BUF, read_seq, &buffered);
+    bench_run("read_direct", FB_FILE_BYTES / FB_MAX_BUF, read_seq, &direct);
+
+    for (unsigned i = 0; i < 3; i++) {
+        struct fb_case c = { sizes[i], 1, 0 };
+        snprintf(name, sizeof(name), "pipe_%u", sizes[i]);
+        bench_run(name, FB_PIPE_BYTES / sizes[i], pipe_stream, &c);
+    }
+
+    remove(FB_COPY);
+    remove(FB_FILE);
+    return bench_finish();
+}
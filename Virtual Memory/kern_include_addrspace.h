@@ -39,6 +39,19 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
+
+/*
+ * Software bits kept in the low byte of a page table entry, which the
+ * TLB does not use. load_into_tlb strips them before the entry reaches
+ * the hardware.
+ */
+#define PTE_PIN_MASK    0x0000000f      /* #transfers pinning the frame, up to 15 */
+#define PTE_PIN_ONE     0x00000001
+#define PTE_SHARED      0x00000010      /* Frame merged with identical pages, mapped read-only */
+#define PTE_REFERENCED  0x00000020      /* Loaded into the TLB since the last reclaim pass */
+#define PTE_COMPRESSED  0x00000040      /* Not valid, the frame bits hold a compressed pool slot */
+#define PTE_SOFT_MASK   0x000000ff
 
 
 /*
@@ -56,8 +69,25 @@ struct as_region {
         int     readable;
         int     writeable; 
         int     executable;
+
+        int     advice;         /* MADV_* access pattern, see kern/mman.h */
 };
 
+/* A page counted for refaulting, candidates for a wired TLB slot */
+struct as_hot_page {
+        vaddr_t         vaddr;
+        uint32_t        refaults;       /* TLB refills since it was last wired */
+};
+
+/*
+ * The R3000 only replaces TLB slots from VM_WIRED_SLOTS up with
+ * tlb_random, the slots below are the address space's wired entries.
+ */
+#define VM_WIRED_SLOTS          8
+#define VM_HOT_PAGES            16      /* Refaulting pages tracked per address space */
+#define VM_WIRE_THRESHOLD       8       /* Refaults that get a page wired */
+#define VM_WIRED_PINNED         0xffffffff      /* Heat of a page wired by madvise */
+
 struct as_region_node {
         struct as_region        *as_region;
 
@@ -80,9 +110,36 @@ struct addrspace {
         struct as_region_node *as_regions_head;      // List of as_regions
 
         uint32_t loading_flag;          /* Usage: https://edstem.org/courses/5289/discussion/433562 */
+
+        struct lock *as_lock;           /* Guards page table entries */
+
+        struct addrspace *as_next;      /* Registry of every address space */
+        uint32_t as_id;                 /* Unique, names the address space in fault traces */
+        unsigned as_refs;               /* The owner's and scanners', guarded by as_registry_lock */
+        struct addrspace *as_scan_next; /* Address spaces the merge scanner holds */
+
+        unsigned as_rss;                /* Resident pages, shared ones included */
+        unsigned as_rss_limit;          /* Pages it may keep resident, 0 for no limit */
+        uint32_t as_trim_hand;          /* Page number where trimming goes on */
+        uint64_t as_trimmed;            /* Pages it compressed to stay in its limit */
+        uint64_t as_overruns;           /* Faults that went over the limit anyway */
+        unsigned as_trim_skip;          /* Faults left before trimming is tried again */
+        unsigned as_zslots;             /* Compressed pool slots charged to it */
+
+        vaddr_t as_wired[VM_WIRED_SLOTS];       /* Page kept in each wired TLB slot, 0 if free */
+        unsigned as_wired_next;                 /* Slot to replace when all are taken */
+        uint32_t as_wired_heat[VM_WIRED_SLOTS]; /* Refaults of each wired page, VM_WIRED_PINNED if asked for */
+        struct as_hot_page as_hot[VM_HOT_PAGES];
 #endif
 };
 
+/* Every address space, for kernel threads that walk them all */
+extern struct addrspace *as_registry;
+extern struct lock *as_registry_lock;
+
+struct addrspace *as_next_registered(uint32_t *id);
+void as_put(struct addrspace *as);
+
 /* Helper functions */
 uint32_t page_table_lookup(struct addrspace *as, vaddr_t fault_addr);
 struct as_region *addr_to_region(struct addrspace *as, vaddr_t fault_addr);
@@ -92,6 +149,50 @@ int insert_into_page_table(struct addrspace *as, uint32_t new_pte, vaddr_t fault
 
 void tlb_flush(void);
 
+int as_wire_page(struct addrspace *as, vaddr_t vaddr);
+void as_load_wired(struct addrspace *as);
+
+/*
+ * Page colours, the groups of cache sets a page can map to. Assumes a
+ * physically indexed cache of VM_NCOLORS pages.
+ */
+#define VM_NCOLORS              4
+#define VM_PAGE_COLOR(vaddr)    (((vaddr) >> 12) % VM_NCOLORS)
+#define VM_FRAME_COLOR(paddr)   (((paddr) >> 12) % VM_NCOLORS)
+#define VM_COLOR_POOL_MAX       8       /* Free frames kept per colour */
+#define VM_COLOR_TRIES          4       /* Frames taken from the kernel looking for a colour */
+
+vaddr_t vm_alloc_frame(vaddr_t vaddr);
+void vm_put_frame(vaddr_t frame);
+unsigned vm_drain_frames(void);
+void vm_free_frame(uint32_t pte);
+
+/* Pages populated after a fault in an MADV_SEQUENTIAL region */
+#define VM_PREFETCH_PAGES 4
+
+/* Pages an address space over its RSS limit tries to trim per fault */
+#define VM_TRIM_BATCH 4
+
+/* Faults an address space goes without trimming after a trim freed nothing */
+#define VM_TRIM_BACKOFF 32
+
+/* Virtual pages a page table can map, the range the clock hands go around */
+#define VM_NPAGES (VADDR_LEVEL_ONE_SIZE * VADDR_LEVEL_TWO_SIZE * VADDR_LEVEL_THREE_SIZE)
+
+int sys_rsslimit(int limit, userptr_t usage, int *errno);
+
+int as_populate_range(struct addrspace *as, vaddr_t start, vaddr_t end);
+void as_discard_range(struct addrspace *as, vaddr_t start, vaddr_t end);
+
+/* Page tables the reaper frees between yields */
+#define VM_REAP_BATCH 4
+
+void as_reaper_bootstrap(void);
+int as_reap_now(void);
+
+int as_pin_pages(struct addrspace *as, vaddr_t vaddr, size_t len, int write, vaddr_t *kvaddrs);
+void as_unpin_pages(struct addrspace *as, vaddr_t vaddr, size_t len);
+
 /*
  * Functions in addrspace.c:
  *
@@ -148,6 +249,11 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+/*
+ * madvise(void *addr, size_t len, int advice)
+ */
+int               sys_madvise(userptr_t addr, size_t len, int advice, int *errno);
+
 
 /*
  * Functions in loadelf.c
@@ -0,0 +1,29 @@
+/*
+ * Declarations for the per-CPU page fault trace.
+ */
+
+#ifndef _FTRACE_H_
+#define _FTRACE_H_
+
+#include <types.h>
+#include <clock.h>
+#include <kern/ftrace.h>
+
+#define FTRACE_RING_SIZE    256     /* Events kept per CPU until read, a power of 2 */
+#define FTRACE_HOT_PAGES    128     /* Distinct pages the summary can count */
+#define FTRACE_TOP          10      /* Pages and regions the summary prints */
+
+/* Nonzero while faults are traced, off at boot */
+extern volatile int ftrace_enabled;
+
+void ftrace_bootstrap(void);
+int ftrace_enable(int on);
+
+void ftrace_record(uint32_t as_id, vaddr_t region, int faulttype, vaddr_t vaddr, int outcome,
+                   const struct timespec *start);
+
+void ftrace_print(void);
+int sys_ftrace_enable(int on, int *errno);
+int sys_ftrace_read(userptr_t buf, size_t max, int *errno);
+
+#endif /* _FTRACE_H_ */
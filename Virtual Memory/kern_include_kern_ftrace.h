@@ -0,0 +1,34 @@
+/*
+ * Page fault trace records returned by ftrace_read(), recorded while
+ * ftrace_enable() has tracing on.
+ * Shared between the kernel and userland.
+ */
+
+#ifndef _KERN_FTRACE_H_
+#define _KERN_FTRACE_H_
+
+#define FTRACE_UNCHANGED    (-1)    /* ftrace_enable() argument that only reads the state */
+
+/* How a fault was resolved */
+#define FTRACE_REFILL       0       /* Resident page loaded into the TLB */
+#define FTRACE_WIRED        1       /* Resident page loaded into a wired TLB slot */
+#define FTRACE_ZERO_PAGE    2       /* New zeroed page */
+#define FTRACE_COW          3       /* Private copy of a merged page */
+#define FTRACE_DECOMPRESS   4       /* Page expanded from the compressed pool */
+#define FTRACE_READONLY     5       /* Write to a read-only page, EFAULT */
+#define FTRACE_BADADDR      6       /* Address outside every region, EFAULT */
+#define FTRACE_ENOMEM       7       /* Out of frames */
+#define FTRACE_NOUTCOMES    8
+
+struct ftrace_event {
+        uint64_t time_ns;           /* When the fault was taken, gettime in ns */
+        uint32_t as_id;             /* Address space of the faulting process */
+        uint32_t vaddr;             /* Faulting address */
+        uint32_t region;            /* Base of its region, 0 if none */
+        uint32_t elapsed_ns;        /* Time spent resolving it */
+        uint8_t  faulttype;         /* VM_FAULT_* */
+        uint8_t  outcome;           /* FTRACE_* */
+        uint16_t cpu;
+};
+
+#endif /* _KERN_FTRACE_H_ */
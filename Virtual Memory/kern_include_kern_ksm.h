@@ -0,0 +1,19 @@
+/*
+ * Same-page merging statistics returned by ksm_stats().
+ * Shared between the kernel and userland.
+ */
+
+#ifndef _KERN_KSM_H_
+#define _KERN_KSM_H_
+
+struct ksm_stats {
+        uint64_t passes;                /* Full scans of every address space */
+        uint64_t pages_scanned;
+        uint64_t pages_merged;          /* Frames given back by merging */
+        uint64_t cow_breaks;            /* Writes that took a private copy */
+        uint64_t scan_ns;               /* Time spent scanning */
+        uint32_t shared_frames;         /* Shared frames currently in use */
+        uint32_t sharers;               /* Mappings of those frames */
+};
+
+#endif /* _KERN_KSM_H_ */
@@ -0,0 +1,21 @@
+/*
+ * Advice values for madvise().
+ * Shared between the kernel and userland.
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * NORMAL, SEQUENTIAL and RANDOM are remembered by every region the
+ * range touches. WILLNEED, DONTNEED and WIRED act on the range right
+ * away, WIRED on as many pages as there are wired TLB slots.
+ */
+#define MADV_NORMAL         0       /* No special treatment */
+#define MADV_SEQUENTIAL     1       /* Populate pages ahead of each fault */
+#define MADV_RANDOM         2       /* No read-ahead */
+#define MADV_WILLNEED       3       /* Populate the range now */
+#define MADV_DONTNEED       4       /* Free the range's frames now, writeable regions only */
+#define MADV_WIRED          5       /* Keep the range's translations in wired TLB slots */
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,20 @@
+/*
+ * Resident set limit and usage, for rsslimit().
+ * Shared between the kernel and userland.
+ */
+
+#ifndef _KERN_RSS_H_
+#define _KERN_RSS_H_
+
+#define RSS_UNCHANGED   (-1)    /* Limit argument that only reads the usage */
+#define RSS_UNLIMITED   0
+
+struct rss_usage {
+        uint32_t rss;                   /* Resident pages */
+        uint32_t limit;                 /* Pages, RSS_UNLIMITED for none */
+        uint32_t compressed;            /* Pages held in the compressed pool, at most limit */
+        uint64_t trimmed;               /* Pages compressed to stay in the limit */
+        uint64_t overruns;              /* Faults that went over it anyway */
+};
+
+#endif /* _KERN_RSS_H_ */
@@ -0,0 +1,20 @@
+/*
+ * Compressed page store statistics returned by zpool_stats().
+ * Shared between the kernel and userland.
+ */
+
+#ifndef _KERN_ZPOOL_H_
+#define _KERN_ZPOOL_H_
+
+struct zpool_stats {
+        uint64_t reclaims;              /* Reclaim passes run on allocation failure */
+        uint64_t compressed;            /* Pages moved into the pool */
+        uint64_t incompressible;        /* Pages that did not shrink enough */
+        uint64_t store_failures;        /* Pages that shrank but found the pool full */
+        uint64_t decompressed;          /* Pages faulted back in */
+        uint64_t decompress_ns;         /* Time spent decompressing on faults */
+        uint32_t stored_pages;          /* Pages in the pool now */
+        uint32_t stored_bytes;          /* Their compressed size */
+};
+
+#endif /* _KERN_ZPOOL_H_ */
@@ -0,0 +1,36 @@
+/*
+ * Declarations for same-page merging.
+ */
+
+#ifndef _KSM_H_
+#define _KSM_H_
+
+#include <types.h>
+#include <kern/ksm.h>
+
+struct addrspace;
+
+#define KSM_SCAN_INTERVAL   5       /* Seconds between scans */
+#define KSM_BUCKETS         64      /* Hash buckets of the shared frame table */
+#define KSM_MAX_CANDIDATES  512     /* Unmerged pages remembered during a scan */
+
+/* A frame mapped read-only by several pages with identical content */
+struct ksm_frame {
+        paddr_t                 paddr;
+        uint32_t                hash;           /* Of the content */
+        int                     refcount;       /* #ptes mapping the frame */
+
+        struct ksm_frame        *next_hash;     /* Chain by content hash */
+        struct ksm_frame        *next_frame;    /* Chain by frame address */
+};
+
+void ksm_bootstrap(void);
+
+void ksm_ref_frame(paddr_t paddr);
+void ksm_put_frame(paddr_t paddr);
+int ksm_unshare(struct addrspace *as, vaddr_t vaddr, int writeable, uint32_t *ret_pte);
+
+void ksm_print(void);
+int sys_ksm_stats(userptr_t buf, int *errno);
+
+#endif /* _KSM_H_ */
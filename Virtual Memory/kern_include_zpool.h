@@ -0,0 +1,38 @@
+/*
+ * Declarations for the compressed in-memory page store.
+ */
+
+#ifndef _ZPOOL_H_
+#define _ZPOOL_H_
+
+#include <types.h>
+#include <kern/zpool.h>
+#include <vm.h>
+
+#define ZPOOL_PAGES         32      /* Frames the pool takes at bootstrap to store pages in */
+#define ZPOOL_CHUNK_SIZE    256     /* Compressed pages are stored in chunks of this many bytes */
+#define ZPOOL_CHUNKS        (ZPOOL_PAGES * PAGE_SIZE / ZPOOL_CHUNK_SIZE)
+#define ZPOOL_MAX_SLOTS     ZPOOL_CHUNKS    /* Compressed pages the pool can hold, one chunk each at least */
+#define ZPOOL_MAX_STORED    2048    /* Pages that compress worse than this stay resident */
+#define ZPOOL_RECLAIM_BATCH 8       /* Frames a reclaim pass tries to free */
+
+/* A compressed page table entry keeps its slot where the frame number goes */
+#define ZPOOL_PTE_SLOT(pte)     ((pte) >> 12)
+#define ZPOOL_SLOT_PTE(slot)    ((uint32_t)(slot) << 12)
+
+void zpool_bootstrap(void);
+
+int zpool_store(vaddr_t page);
+void zpool_load(int slot, vaddr_t page);
+int zpool_dup(int slot);
+void zpool_free(int slot);
+
+struct addrspace;
+
+int zpool_evict_page(struct addrspace *as, vaddr_t vaddr, uint32_t pte);
+int vm_reclaim(unsigned want);
+
+void zpool_print(void);
+int sys_zpool_stats(userptr_t buf, int *errno);
+
+#endif /* _ZPOOL_H_ */
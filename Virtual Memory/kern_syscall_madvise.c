@@ -0,0 +1,71 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+
+/*
+ * Give the VM a hint about how [addr, addr + len) will be used.
+ * addr must be page aligned and the range must touch at least one
+ * region. MADV_DONTNEED is refused on ranges touching a region that is
+ * not writeable, nothing could bring back its loaded contents.
+ */
+int sys_madvise(userptr_t addr, size_t len, int advice, int *errno) {
+    vaddr_t start = (vaddr_t)addr;
+    vaddr_t end = start + ROUNDUP(len, PAGE_SIZE);
+
+    if ((start & ~PAGE_FRAME) != 0 || advice < MADV_NORMAL || advice > MADV_WIRED) {
+        *errno = EINVAL;
+        return -1;
+    }
+    if (end < start || end > USERSPACETOP) {
+        *errno = ENOMEM;
+        return -1;
+    }
+
+    struct addrspace *as = proc_getas();
+    if (as == NULL) {
+        *errno = EFAULT;
+        return -1;
+    }
+
+    lock_acquire(as->as_lock);
+
+    // Remember access patterns on every region the range overlaps
+    int found = 0;
+    int readonly = 0;
+    struct as_region_node *curr;
+    for (curr = as->as_regions_head; curr != NULL; curr = curr->next) {
+        struct as_region *region = curr->as_region;
+        if (region->vbase >= end || region->vtop <= start) continue;
+
+        found = 1;
+        if (!region->writeable) readonly = 1;
+        if (advice == MADV_NORMAL || advice == MADV_SEQUENTIAL || advice == MADV_RANDOM) {
+            region->advice = advice;
+        }
+    }
+
+    *errno = found ? 0 : ENOMEM;
+    if (found && advice == MADV_WILLNEED) {
+        *errno = as_populate_range(as, start, end);
+    } else if (found && advice == MADV_DONTNEED) {
+        if (readonly) {
+            *errno = EINVAL;
+        } else {
+            as_discard_range(as, start, end);
+        }
+    } else if (found && advice == MADV_WIRED) {
+        for (vaddr_t page = start; page < end && page < start + VM_WIRED_SLOTS * PAGE_SIZE; page += PAGE_SIZE) {
+            if (addr_to_region(as, page) != NULL) as_wire_page(as, page);
+        }
+    }
+
+    lock_release(as->as_lock);
+
+    return *errno ? -1 : 0;
+}
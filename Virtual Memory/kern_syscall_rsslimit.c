@@ -0,0 +1,44 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/rss.h>
+#include <lib.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <copyinout.h>
+#include <addrspace.h>
+#include <vm.h>
+
+/*
+ * Set the number of pages the calling process may keep resident, unless
+ * limit is RSS_UNCHANGED, and report its usage to usage if not NULL.
+ * A process over a lowered limit trims itself on its next faults. The
+ * limit also caps the compressed pool slots the process may hold, and
+ * is inherited by fork.
+ */
+int sys_rsslimit(int limit, userptr_t usage, int *errno) {
+    struct rss_usage copy;
+
+    if (limit < RSS_UNCHANGED) {
+        *errno = EINVAL;
+        return -1;
+    }
+
+    struct addrspace *as = proc_getas();
+    if (as == NULL) {
+        *errno = EFAULT;
+        return -1;
+    }
+
+    lock_acquire(as->as_lock);
+    if (limit != RSS_UNCHANGED) as->as_rss_limit = limit;
+    copy.rss = as->as_rss;
+    copy.limit = as->as_rss_limit;
+    copy.compressed = as->as_zslots;
+    copy.trimmed = as->as_trimmed;
+    copy.overruns = as->as_overruns;
+    lock_release(as->as_lock);
+
+    *errno = usage == NULL ? 0 : copyout(&copy, usage, sizeof(copy));
+    return *errno ? -1 : 0;
+}
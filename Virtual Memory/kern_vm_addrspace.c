@@ -37,6 +37,11 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <synch.h>
+#include <thread.h>
+#include <kern/mman.h>
+#include <ksm.h>
+#include <zpool.h>
 
 #include <machine/tlb.h>
 
@@ -44,6 +49,10 @@
 #define VADDR_LEVEL_TWO_SIZE 64
 #define VADDR_LEVEL_THREE_SIZE 64
 #define USERSTACKSIZE 16 * PAGE_SIZE
+struct addrspace *as_registry = NULL;
+struct lock *as_registry_lock = NULL;
+static uint32_t next_as_id = 1;
+
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
@@ -78,6 +87,39 @@ as_create(void)
 	/* Initialize loading flag */
 	as->loading_flag = 0;
 
+	/* Nothing wired or counted yet */
+	for (int i = 0; i < VM_WIRED_SLOTS; i++) {
+		as->as_wired[i] = 0;
+		as->as_wired_heat[i] = 0;
+	}
+	as->as_wired_next = 0;
+
+	as->as_rss = 0;
+	as->as_rss_limit = 0;
+	as->as_trim_hand = 0;
+	as->as_trimmed = 0;
+	as->as_overruns = 0;
+	as->as_trim_skip = 0;
+	as->as_zslots = 0;
+	for (int i = 0; i < VM_HOT_PAGES; i++) {
+		as->as_hot[i].vaddr = 0;
+		as->as_hot[i].refaults = 0;
+	}
+
+	if ((as->as_lock = lock_create("as_lock")) == NULL) {
+		kfree(as->page_table);
+		kfree(as);
+		return NULL;
+	}
+
+	/* Register so the page scanners find it */
+	lock_acquire(as_registry_lock);
+	as->as_id = next_as_id++;
+	as->as_refs = 1;
+	as->as_next = as_registry;
+	as_registry = as;
+	lock_release(as_registry_lock);
+
 	return as;
 }
 
@@ -89,41 +131,72 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
+	/* Other threads of the parent may fault while it is copied */
+	lock_acquire(old->as_lock);
+
 	/* Copy page table */
 	for (int i = 0; i < VADDR_LEVEL_ONE_SIZE; i++) {
 		if (old->page_table[i] != NULL) {
 			/* Allocate level two */
 			if ((newas->page_table[i] = kmalloc(VADDR_LEVEL_TWO_SIZE * sizeof(uint32_t *))) == NULL) {
+				lock_release(old->as_lock);
 				as_destroy(newas);
 				*ret = NULL;
 				return ENOMEM;
 			}
 
+			/* Initialize to all null, so a failure below leaves nothing
+			 * for the reaper to trip over */
+			for (int j = 0; j < VADDR_LEVEL_TWO_SIZE; j++) newas->page_table[i][j] = NULL;
+
 			/* Copy level two */
 			for (int j = 0; j < VADDR_LEVEL_TWO_SIZE; j++) {
-				if (old->page_table[i][j] == NULL) {
-					newas->page_table[i][j] = NULL;
-				} else {
+				if (old->page_table[i][j] != NULL) {
 					/* Allocate level three */
 					if ((newas->page_table[i][j] = kmalloc(VADDR_LEVEL_THREE_SIZE * sizeof(uint32_t))) == NULL) {
+						lock_release(old->as_lock);
 						as_destroy(newas);
 						*ret = NULL;
 						return ENOMEM;
 					}
 
+					/* Initialize to all 0 */
+					for (int k = 0; k < VADDR_LEVEL_THREE_SIZE; k++) newas->page_table[i][j][k] = 0;
+
 					/* Copy level three */
 					for (int k = 0; k < VADDR_LEVEL_THREE_SIZE; k++) {
 						if (old->page_table[i][j][k] == 0) {
-							newas->page_table[i][j][k] = 0;
+							continue;
+						} else if (old->page_table[i][j][k] & PTE_COMPRESSED) {
+							/* The child gets its own compressed copy */
+							int slot = zpool_dup(ZPOOL_PTE_SLOT(old->page_table[i][j][k]));
+							if (slot == -1) {
+								lock_release(old->as_lock);
+								as_destroy(newas);
+								*ret = NULL;
+								return ENOMEM;
+							}
+							newas->page_table[i][j][k] = ZPOOL_SLOT_PTE(slot) | PTE_COMPRESSED;
+							newas->as_zslots++;
+						} else if (old->page_table[i][j][k] & PTE_SHARED) {
+							/* Merged frames are read-only, the child maps them too */
+							ksm_ref_frame(old->page_table[i][j][k] & PAGE_FRAME);
+							newas->page_table[i][j][k] = old->page_table[i][j][k] & ~PTE_PIN_MASK;
 						} else {
-							vaddr_t new_page = alloc_kpages(1);
-							bzero((void *)new_page, PAGE_SIZE);
+							vaddr_t vaddr = (i << VADDR_LEVEL_ONE_SHIFT) | (j << VADDR_LEVEL_TWO_SHIFT) | (k << VADDR_LEVEL_THREE_SHIFT);
+							vaddr_t new_page = vm_alloc_frame(vaddr);
+							if (new_page == 0) {
+								lock_release(old->as_lock);
+								as_destroy(newas);
+								*ret = NULL;
+								return ENOMEM;
+							}
 
 							/* Copy page frame cotent */
 							memmove((void *)new_page, (const void*)PADDR_TO_KVADDR(old->page_table[i][j][k] & PAGE_FRAME), PAGE_SIZE);
 
-							/* Copy page table content */
-							newas->page_table[i][j][k] = (KVADDR_TO_PADDR(new_page) & PAGE_FRAME) | (old->page_table[i][j][k] & (~(PAGE_FRAME)));
+							/* Copy page table content, the child's frame is not pinned */
+							newas->page_table[i][j][k] = (KVADDR_TO_PADDR(new_page) & PAGE_FRAME) | (old->page_table[i][j][k] & ~(PAGE_FRAME | PTE_PIN_MASK));
 						}
 					}
 				}
@@ -131,11 +204,20 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		}
 	}
 
+	/* The child has the same pages resident, under the same limit */
+	newas->as_rss = old->as_rss;
+	newas->as_rss_limit = old->as_rss_limit;
+
+	lock_release(old->as_lock);
+
 	/* Copy regions list */
 	struct as_region_node *curr = old->as_regions_head;
 	while (curr != NULL){
 		struct as_region *region = curr->as_region;
-		as_define_region(newas, region->vbase, region->memsize, region->readable, region->writeable, region->executable);
+		if (as_define_region(newas, region->vbase, region->memsize, region->readable, region->writeable, region->executable) == 0) {
+			/* The new region went to the front */
+			newas->as_regions_head->as_region->advice = region->advice;
+		}
 		curr = curr->next;
 	}
 
@@ -143,12 +225,171 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	return 0;
 }
 
-/* Free all memory used by as */
+/*
+ * Address space reaper.
+ *
+ * Freeing every frame and table of a large address space takes long, so
+ * as_destroy only unlinks the address space and queues it. A kernel
+ * thread frees queued address spaces VM_REAP_BATCH page tables at a
+ * time, yielding in between, so the exiting process and its parent do
+ * not wait for it.
+ */
+
+static struct addrspace *reap_list = NULL;     /* Queued address spaces, linked by as_next */
+static struct lock *reap_lock = NULL;
+static struct cv *reap_cv = NULL;
+
+/* Take the next queued address space, NULL if none */
+static struct addrspace *
+reap_pop(void)
+{
+	lock_acquire(reap_lock);
+	struct addrspace *as = reap_list;
+	if (as != NULL) reap_list = as->as_next;
+	lock_release(reap_lock);
+
+	return as;
+}
+
+/* Free the frames and tables of a queued address space. Nothing else can
+ * reach it any more, so no lock is needed. yield is set to give up the
+ * cpu between batches.
+ */
+static void
+reap(struct addrspace *as, int yield)
+{
+	int batch = 0;
+
+	for (int i = 0; i < VADDR_LEVEL_ONE_SIZE; i++) {
+		if (as->page_table[i] == NULL) continue;
+
+		for (int j = 0; j < VADDR_LEVEL_TWO_SIZE; j++) {
+			if (as->page_table[i][j] == NULL) continue;
+
+			for (int k = 0; k < VADDR_LEVEL_THREE_SIZE; k++) {
+				if (as->page_table[i][j][k] != 0) {
+					vm_free_frame(as->page_table[i][j][k]);
+				}
+			}
+			kfree(as->page_table[i][j]);
+
+			if (yield && ++batch == VM_REAP_BATCH) {
+				batch = 0;
+				thread_yield();
+			}
+		}
+		kfree(as->page_table[i]);
+	}
+
+	kfree(as->page_table);
+	lock_destroy(as->as_lock);
+	kfree(as);
+}
+
+static void
+as_reaper(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		lock_acquire(reap_lock);
+		while (reap_list == NULL) {
+			cv_wait(reap_cv, reap_lock);
+		}
+		lock_release(reap_lock);
+
+		struct addrspace *as;
+		while ((as = reap_pop()) != NULL) {
+			reap(as, 1);
+		}
+	}
+}
+
+void
+as_reaper_bootstrap(void)
+{
+	reap_lock = lock_create("reap_lock");
+	reap_cv = cv_create("reap_cv");
+	if (reap_lock == NULL || reap_cv == NULL) {
+		panic("Insufficient memory for address space reaper\n");
+	}
+
+	if (thread_fork("as reaper", kproc, as_reaper, NULL, 0) != 0) {
+		panic("Cannot start address space reaper\n");
+	}
+}
+
+/* Free every queued address space now, for a fault that ran out of
+ * frames. Return how many were freed.
+ */
+int
+as_reap_now(void)
+{
+	int reaped = 0;
+
+	struct addrspace *as;
+	while ((as = reap_pop()) != NULL) {
+		reap(as, 0);
+		reaped++;
+	}
+
+	return reaped;
+}
+
+/* Return the address space registered after the one numbered *id, or
+ * the first if *id is 0, with a reference taken. Set *id to its number.
+ * NULL at the end of the registry. Lets a scanner walk the registry
+ * without holding as_registry_lock across address spaces.
+ */
+struct addrspace *
+as_next_registered(uint32_t *id)
+{
+	lock_acquire(as_registry_lock);
+
+	/* Newer address spaces go first, so numbers fall along the list */
+	struct addrspace *as = as_registry;
+	while (as != NULL && *id != 0 && as->as_id >= *id) as = as->as_next;
+	if (as != NULL) {
+		as->as_refs++;
+		*id = as->as_id;
+	}
+
+	lock_release(as_registry_lock);
+	return as;
+}
+
+/* Drop a reference, the last one hands the memory to the reaper */
+void
+as_put(struct addrspace *as)
+{
+	lock_acquire(as_registry_lock);
+	int last = --as->as_refs == 0;
+	lock_release(as_registry_lock);
+
+	if (!last) return;
+
+	/* The page table goes in the background */
+	lock_acquire(reap_lock);
+	as->as_next = reap_list;
+	reap_list = as;
+	cv_signal(reap_cv, reap_lock);
+	lock_release(reap_lock);
+}
+
+/* Detach as and drop the owner's reference */
 void
 as_destroy(struct addrspace *as)
 {	
 	if (as == NULL) return;
 
+	/* Unregister first, the scanners may be walking it */
+	lock_acquire(as_registry_lock);
+	struct addrspace **link = &as_registry;
+	while (*link != as) link = &(*link)->as_next;
+	*link = as->as_next;
+	lock_release(as_registry_lock);
+
 	/* Clear regions */
 	struct as_region_node *curr = as->as_regions_head;
 	struct as_region_node *prev = NULL;
@@ -158,30 +399,9 @@ as_destroy(struct addrspace *as)
 		kfree(prev->as_region);
 		kfree(prev);
 	}
-	
-	/* Clear page table */
-	if (as->page_table != NULL) {
-		for (int i = 0; i < VADDR_LEVEL_ONE_SIZE; i++) {
-
-			if (as->page_table[i] != NULL) {
-				for (int j = 0; j < VADDR_LEVEL_TWO_SIZE; j++) {
-					
-					if (as->page_table[i][j] != NULL) {
-						for (int k = 0; k < VADDR_LEVEL_THREE_SIZE; k++){
-							if (as->page_table[i][j][k] != 0){
-								free_kpages(PADDR_TO_KVADDR(as->page_table[i][j][k] & PAGE_FRAME));
-							}
-						}
-						kfree(as->page_table[i][j]);
-					}
-				}	
-				kfree(as->page_table[i]);
-			}
-		}
-		kfree(as->page_table);
-	}
+	as->as_regions_head = NULL;
 
-	kfree(as);
+	as_put(as);
 }
 
 // Flush TLB
@@ -192,13 +412,18 @@ as_activate(void)
 	if ((as = proc_getas()) == NULL) return;
 
 	tlb_flush();
+
+	/* Put back the wired entries the flush dropped */
+	as_load_wired(as);
 }
 
-// Flush TLB
+// Flush TLB, without reloading wired entries of an address space on its way out
 void
 as_deactivate(void)
 {
-	as_activate();
+	if (proc_getas() == NULL) return;
+
+	tlb_flush();
 }
 
 /*
@@ -233,6 +458,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	region->readable = readable;
 	region->writeable = writeable;
 	region->executable = executable; 
+	region->advice = MADV_NORMAL;
 
 	/* Insert the region node to the regions list */
 	struct as_region_node *new_region_node;
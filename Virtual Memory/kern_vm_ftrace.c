@@ -0,0 +1,247 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/ftrace.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <membar.h>
+#include <synch.h>
+#include <clock.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <ftrace.h>
+
+/*
+ * Per-CPU page fault trace.
+ *
+ * Tracing is off until ftrace_enable turns it on, and vm_fault only
+ * times a fault and finds its region while it is on. It then appends
+ * an event to its CPU's ring with interrupts off and no lock. Each
+ * ring has one writer, its CPU, which only moves head, and readers
+ * only move tail, so the two never race on an index. A full ring drops
+ * new events and counts them rather than overwrite events a reader may
+ * be copying.
+ *
+ * sys_ftrace_read drains the rings. ftrace_print summarises what is
+ * still in them, the most faulting pages and regions, without draining.
+ */
+
+struct ftrace_ring {
+    struct ftrace_event events[FTRACE_RING_SIZE];
+    volatile unsigned   head;       // Next event written, moved by the owning CPU
+    volatile unsigned   tail;       // Next event read, moved under ftrace_lock
+    uint64_t            dropped;    // Events lost to a full ring
+};
+
+volatile int ftrace_enabled = 0;
+
+static struct ftrace_ring *rings = NULL;
+static unsigned num_rings = 0;
+static struct lock *ftrace_lock = NULL;     // Serialises readers and the summary
+
+static const char *outcome_names[FTRACE_NOUTCOMES] = {
+    "refill", "wired", "zero page", "cow", "decompress", "readonly", "bad address", "enomem",
+};
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 recording functions                //
+////////////////////////////////////////////////////////
+
+void ftrace_bootstrap() {
+    num_rings = cpu_numcpus();
+    rings = kmalloc(num_rings * sizeof(struct ftrace_ring));
+    ftrace_lock = lock_create("ftrace_lock");
+    if (rings == NULL || ftrace_lock == NULL) {
+        panic("Insufficient memory for page fault trace\n");
+    }
+    bzero(rings, num_rings * sizeof(struct ftrace_ring));
+}
+
+// Turn tracing on or off, return whether it was on
+int ftrace_enable(int on) {
+    int was = ftrace_enabled;
+    ftrace_enabled = on;
+    return was;
+}
+
+// Record a fault of the address space that started at start
+void ftrace_record(uint32_t as_id, vaddr_t region, int faulttype, vaddr_t vaddr, int outcome,
+                   const struct timespec *start) {
+    if (rings == NULL) return;
+
+    struct timespec now, diff;
+    gettime(&now);
+    timespec_sub(&now, start, &diff);
+
+    struct ftrace_event event;
+    event.time_ns = (uint64_t)start->tv_sec * 1000000000 + start->tv_nsec;
+    event.as_id = as_id;
+    event.vaddr = vaddr;
+    event.region = region;
+    event.elapsed_ns = diff.tv_sec * 1000000000 + diff.tv_nsec;
+    event.faulttype = faulttype;
+    event.outcome = outcome;
+
+    int spl = splhigh();
+    struct ftrace_ring *ring = &rings[curcpu->c_number];
+    event.cpu = curcpu->c_number;
+
+    if (ring->head - ring->tail >= FTRACE_RING_SIZE) {
+        ring->dropped++;
+    } else {
+        ring->events[ring->head % FTRACE_RING_SIZE] = event;
+        membar_store_store();   // The event is in place before readers see it
+        ring->head++;
+    }
+    splx(spl);
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                     summary                        //
+////////////////////////////////////////////////////////
+
+// Faults counted against one page or region of an address space
+struct ftrace_hot {
+    uint32_t    as_id;
+    uint32_t    vaddr;
+    unsigned    faults;
+    uint64_t    total_ns;
+};
+
+static struct ftrace_hot hot_pages[FTRACE_HOT_PAGES];      // Guarded by ftrace_lock
+static struct ftrace_hot hot_regions[FTRACE_HOT_PAGES];
+
+// Count a fault in the table, return 0 if the table had no room for it
+static int count_hot(struct ftrace_hot *table, unsigned *n, uint32_t as_id, uint32_t vaddr, uint32_t ns) {
+    unsigned i;
+    for (i = 0; i < *n; i++) {
+        if (table[i].as_id == as_id && table[i].vaddr == vaddr) break;
+    }
+
+    if (i == *n) {
+        if (*n == FTRACE_HOT_PAGES) return 0;
+        table[i].as_id = as_id;
+        table[i].vaddr = vaddr;
+        table[i].faults = 0;
+        table[i].total_ns = 0;
+        (*n)++;
+    }
+
+    table[i].faults++;
+    table[i].total_ns += ns;
+    return 1;
+}
+
+// Print the FTRACE_TOP entries with the most faults, reorders the table
+static void print_top(const char *what, struct ftrace_hot *table, unsigned n) {
+    for (unsigned i = 0; i < n && i < FTRACE_TOP; i++) {
+        unsigned max = i;
+        for (unsigned j = i + 1; j < n; j++) {
+            if (table[j].faults > table[max].faults) max = j;
+        }
+
+        struct ftrace_hot top = table[max];
+        table[max] = table[i];
+        table[i] = top;
+
+        kprintf("ftrace: %s as %u 0x%08x: %u faults, avg %llu ns\n", what, top.as_id, top.vaddr,
+                top.faults, (unsigned long long)(top.total_ns / top.faults));
+    }
+}
+
+// Print the hottest pages and regions among the events not read yet, for the kernel menu
+void ftrace_print() {
+    unsigned num_pages = 0, num_regions = 0, untracked = 0;
+    unsigned outcomes[FTRACE_NOUTCOMES];
+    uint64_t dropped = 0;
+
+    bzero(outcomes, sizeof(outcomes));
+
+    lock_acquire(ftrace_lock);
+
+    for (unsigned cpu = 0; cpu < num_rings; cpu++) {
+        struct ftrace_ring *ring = &rings[cpu];
+        unsigned head = ring->head;
+        membar_load_load();
+        dropped += ring->dropped;
+
+        for (unsigned t = ring->tail; t != head; t++) {
+            struct ftrace_event *event = &ring->events[t % FTRACE_RING_SIZE];
+            outcomes[event->outcome]++;
+            if (!count_hot(hot_pages, &num_pages, event->as_id, event->vaddr & PAGE_FRAME, event->elapsed_ns)) untracked++;
+            if (event->region != 0) count_hot(hot_regions, &num_regions, event->as_id, event->region, event->elapsed_ns);
+        }
+    }
+
+    kprintf("ftrace: tracing %s\n", ftrace_enabled ? "on" : "off");
+    for (int i = 0; i < FTRACE_NOUTCOMES; i++) {
+        kprintf("ftrace: %-12s %u\n", outcome_names[i], outcomes[i]);
+    }
+    kprintf("ftrace: %llu dropped, %u beyond the hot page table\n", (unsigned long long)dropped, untracked);
+
+    print_top("page", hot_pages, num_pages);
+    print_top("region", hot_regions, num_regions);
+
+    lock_release(ftrace_lock);
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 interface functions                //
+////////////////////////////////////////////////////////
+
+/* Turn tracing on or off unless on is FTRACE_UNCHANGED, return whether
+ * it was on.
+ */
+int sys_ftrace_enable(int on, int *errno) {
+    if (on != FTRACE_UNCHANGED && on != 0 && on != 1) {
+        *errno = EINVAL;
+        return -1;
+    }
+
+    *errno = 0;
+    return on == FTRACE_UNCHANGED ? ftrace_enabled : ftrace_enable(on);
+}
+
+#define FTRACE_READ_CHUNK 16    // Events copied out at a time
+
+/* Move up to max events, oldest first per CPU, to the user buffer and
+ * return how many were moved.
+ */
+int sys_ftrace_read(userptr_t buf, size_t max, int *errno) {
+    struct ftrace_event chunk[FTRACE_READ_CHUNK];
+    size_t copied = 0;
+
+    *errno = 0;
+    lock_acquire(ftrace_lock);
+
+    for (unsigned cpu = 0; cpu < num_rings && copied < max && *errno == 0; cpu++) {
+        struct ftrace_ring *ring = &rings[cpu];
+        unsigned head = ring->head;
+        membar_load_load();     // Read events only up to the head seen
+
+        while (ring->tail != head && copied < max) {
+            size_t n = 0;
+            unsigned t = ring->tail;
+            while (t != head && n < FTRACE_READ_CHUNK && copied + n < max) {
+                chunk[n++] = ring->events[t++ % FTRACE_RING_SIZE];
+            }
+
+            // The fault trace of copyout itself goes to the rings, no lock is held against it
+            *errno = copyout(chunk, (userptr_t)((char *)buf + copied * sizeof(struct ftrace_event)),
+                             n * sizeof(struct ftrace_event));
+            if (*errno) break;
+
+            membar_any_any();   // Done with the slots before the writer may reuse them
+            ring->tail = t;
+            copied += n;
+        }
+    }
+
+    lock_release(ftrace_lock);
+
+    return *errno ? -1 : (int)copied;
+}
@@ -0,0 +1,378 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/ksm.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <clock.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <mips/tlb.h>
+#include <ksm.h>
+
+/*
+ * Same-page merging.
+ *
+ * A kernel thread walks every registered address space every
+ * KSM_SCAN_INTERVAL seconds and hashes each resident page. A page whose
+ * content matches a shared frame is remapped to it and its own frame
+ * freed. A page matching another page seen earlier in the scan turns
+ * that page's frame into a new shared frame. Shared pages are mapped
+ * read-only with PTE_SHARED set, a write fault gives the writer a
+ * private copy again (ksm_unshare).
+ *
+ * The scanner takes the registry lock only to step to the next address
+ * space, so fork, exec and exit are not held up by a scan. It keeps a
+ * reference on every address space it has scanned until the scan ends,
+ * so none it remembers pages of is freed under it. It is the only code
+ * that holds two as locks at once. Lock order is as_registry_lock, then
+ * as_lock, then ksm_lock.
+ */
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 shared frame table                 //
+////////////////////////////////////////////////////////
+
+static struct ksm_frame *by_hash[KSM_BUCKETS];
+static struct ksm_frame *by_frame[KSM_BUCKETS];
+static struct lock *ksm_lock = NULL;       // Guards both tables and stats
+static struct ksm_stats stats;
+
+static uint32_t frame_bucket(paddr_t paddr) {
+    return (paddr / PAGE_SIZE) % KSM_BUCKETS;
+}
+
+// FNV-1a over the words of a frame
+static uint32_t hash_frame(paddr_t paddr) {
+    const uint32_t *word = (const uint32_t *)PADDR_TO_KVADDR(paddr);
+    uint32_t hash = 2166136261u;
+    for (unsigned i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        hash = (hash ^ word[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int same_content(paddr_t a, paddr_t b) {
+    return memcmp((void *)PADDR_TO_KVADDR(a), (void *)PADDR_TO_KVADDR(b), PAGE_SIZE) == 0;
+}
+
+// Return the shared frame at paddr, caller holds ksm_lock
+static struct ksm_frame *find_frame(paddr_t paddr) {
+    struct ksm_frame *curr;
+    for (curr = by_frame[frame_bucket(paddr)]; curr != NULL; curr = curr->next_frame) {
+        if (curr->paddr == paddr) return curr;
+    }
+    return NULL;
+}
+
+// Return a shared frame holding the same content, caller holds ksm_lock
+static struct ksm_frame *find_content(paddr_t paddr, uint32_t hash) {
+    struct ksm_frame *curr;
+    for (curr = by_hash[hash % KSM_BUCKETS]; curr != NULL; curr = curr->next_hash) {
+        if (curr->hash == hash && same_content(curr->paddr, paddr)) return curr;
+    }
+    return NULL;
+}
+
+// Start sharing the frame, caller holds ksm_lock. NULL if out of memory
+static struct ksm_frame *add_frame(paddr_t paddr, uint32_t hash) {
+    struct ksm_frame *frame = kmalloc(sizeof(struct ksm_frame));
+    if (frame == NULL) return NULL;
+
+    frame->paddr = paddr;
+    frame->hash = hash;
+    frame->refcount = 0;
+    frame->next_hash = by_hash[hash % KSM_BUCKETS];
+    by_hash[hash % KSM_BUCKETS] = frame;
+    frame->next_frame = by_frame[frame_bucket(paddr)];
+    by_frame[frame_bucket(paddr)] = frame;
+    stats.shared_frames++;
+
+    return frame;
+}
+
+// Stop tracking the frame, which now has a single owner. Caller holds ksm_lock
+static void remove_frame(struct ksm_frame *frame) {
+    struct ksm_frame **curr;
+    for (curr = &by_hash[frame->hash % KSM_BUCKETS]; *curr != frame; curr = &(*curr)->next_hash);
+    *curr = frame->next_hash;
+    for (curr = &by_frame[frame_bucket(frame->paddr)]; *curr != frame; curr = &(*curr)->next_frame);
+    *curr = frame->next_frame;
+
+    stats.shared_frames--;
+    kfree(frame);
+}
+
+// Another pte maps the shared frame, as_copy shares instead of copying
+void ksm_ref_frame(paddr_t paddr) {
+    lock_acquire(ksm_lock);
+    struct ksm_frame *frame = find_frame(paddr);
+    KASSERT(frame != NULL);
+    frame->refcount++;
+    stats.sharers++;
+    lock_release(ksm_lock);
+}
+
+// A pte stops mapping the shared frame, freeing it with the last one
+void ksm_put_frame(paddr_t paddr) {
+    lock_acquire(ksm_lock);
+    struct ksm_frame *frame = find_frame(paddr);
+    KASSERT(frame != NULL);
+    frame->refcount--;
+    stats.sharers--;
+    int last = frame->refcount == 0;
+    if (last) remove_frame(frame);
+    lock_release(ksm_lock);
+
+    if (last) vm_put_frame(PADDR_TO_KVADDR(paddr));
+}
+
+/* Give the shared page at vaddr a private frame after a write fault and
+ * hand back its new pte. The last sharer keeps the frame without a copy.
+ * Caller holds as->as_lock.
+ */
+int ksm_unshare(struct addrspace *as, vaddr_t vaddr, int writeable, uint32_t *ret_pte) {
+    uint32_t pte = page_table_lookup(as, vaddr);
+    paddr_t paddr = pte & PAGE_FRAME;
+    KASSERT(pte & PTE_SHARED);
+
+    lock_acquire(ksm_lock);
+    struct ksm_frame *frame = find_frame(paddr);
+    KASSERT(frame != NULL);
+    stats.cow_breaks++;
+
+    if (frame->refcount == 1) {
+        // Nobody else maps it any more
+        stats.sharers--;
+        remove_frame(frame);
+        lock_release(ksm_lock);
+    } else {
+        lock_release(ksm_lock);
+
+        vaddr_t copy = vm_alloc_frame(vaddr);
+        if (copy == 0) return ENOMEM;
+        memmove((void *)copy, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+        ksm_put_frame(paddr);
+        paddr = KVADDR_TO_PADDR(copy);
+    }
+
+    uint32_t new_pte = paddr | (pte & ~(PAGE_FRAME | PTE_SHARED | TLBLO_DIRTY));
+    if (writeable) new_pte |= TLBLO_DIRTY;
+    insert_into_page_table(as, new_pte, vaddr);
+
+    *ret_pte = new_pte;
+    return 0;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                     scanner                        //
+////////////////////////////////////////////////////////
+
+// A page seen in this scan that matched nothing yet
+struct ksm_candidate {
+    uint32_t            hash;
+    struct addrspace    *as;
+    vaddr_t             vaddr;
+    int                 next;       // Index of the next candidate in the bucket, -1 at the end
+};
+
+static struct ksm_candidate candidates[KSM_MAX_CANDIDATES];
+static int candidate_buckets[KSM_BUCKETS];
+static int num_candidates = 0;
+
+static void clear_candidates(void) {
+    num_candidates = 0;
+    for (int i = 0; i < KSM_BUCKETS; i++) candidate_buckets[i] = -1;
+}
+
+/* Map vaddr of as, whose frame is private, to the shared frame and free
+ * its own frame. Caller holds as->as_lock.
+ */
+static void map_shared(struct addrspace *as, vaddr_t vaddr, uint32_t pte, struct ksm_frame *frame) {
+    if ((pte & PAGE_FRAME) != frame->paddr) {
+        vm_put_frame(PADDR_TO_KVADDR(pte & PAGE_FRAME));
+        stats.pages_merged++;
+    }
+    frame->refcount++;
+    stats.sharers++;
+
+    uint32_t new_pte = frame->paddr | (pte & ~(PAGE_FRAME | TLBLO_DIRTY)) | PTE_SHARED;
+    insert_into_page_table(as, new_pte, vaddr);
+}
+
+// Check if the page can be merged, 1 if so
+static int mergeable(uint32_t pte) {
+    return (pte & TLBLO_VALID) && (pte & (PTE_SHARED | PTE_PIN_MASK)) == 0;
+}
+
+/* Merge the page with a shared frame or a page seen earlier, or
+ * remember it. Caller holds as->as_lock.
+ */
+static void scan_page(struct addrspace *as, vaddr_t vaddr, uint32_t pte) {
+    paddr_t paddr = pte & PAGE_FRAME;
+    uint32_t hash = hash_frame(paddr);
+    stats.pages_scanned++;
+
+    // Same content as a frame already shared
+    lock_acquire(ksm_lock);
+    struct ksm_frame *frame = find_content(paddr, hash);
+    if (frame != NULL) {
+        map_shared(as, vaddr, pte, frame);
+        lock_release(ksm_lock);
+        return;
+    }
+    lock_release(ksm_lock);
+
+    // Same content as a page seen earlier in this scan
+    int *link;
+    for (link = &candidate_buckets[hash % KSM_BUCKETS]; *link != -1; link = &candidates[*link].next) {
+        struct ksm_candidate *cand = &candidates[*link];
+        if (cand->hash != hash) continue;
+
+        if (cand->as != as) lock_acquire(cand->as->as_lock);
+
+        // The other page may have changed since it was hashed
+        uint32_t cand_pte = page_table_lookup(cand->as, cand->vaddr);
+        int merged = 0;
+        if (mergeable(cand_pte) && same_content(cand_pte & PAGE_FRAME, paddr)) {
+            lock_acquire(ksm_lock);
+            if ((frame = add_frame(cand_pte & PAGE_FRAME, hash)) != NULL) {
+                map_shared(cand->as, cand->vaddr, cand_pte, frame);
+                map_shared(as, vaddr, pte, frame);
+                merged = 1;
+            }
+            lock_release(ksm_lock);
+        }
+
+        if (cand->as != as) lock_release(cand->as->as_lock);
+
+        if (merged) {
+            // Drop the candidate, it is shared now
+            *link = cand->next;
+            return;
+        }
+    }
+
+    // Nothing matches, remember it for the rest of the scan
+    if (num_candidates < KSM_MAX_CANDIDATES) {
+        struct ksm_candidate *cand = &candidates[num_candidates];
+        cand->hash = hash;
+        cand->as = as;
+        cand->vaddr = vaddr;
+        cand->next = candidate_buckets[hash % KSM_BUCKETS];
+        candidate_buckets[hash % KSM_BUCKETS] = num_candidates++;
+    }
+}
+
+// Scan every resident page of as, caller holds as->as_lock
+static void scan_as(struct addrspace *as) {
+    for (uint32_t i = 0; i < VADDR_LEVEL_ONE_SIZE; i++) {
+        if (as->page_table[i] == NULL) continue;
+        for (uint32_t j = 0; j < VADDR_LEVEL_TWO_SIZE; j++) {
+            if (as->page_table[i][j] == NULL) continue;
+            for (uint32_t k = 0; k < VADDR_LEVEL_THREE_SIZE; k++) {
+                uint32_t pte = as->page_table[i][j][k];
+                if (!mergeable(pte)) continue;
+
+                vaddr_t vaddr = (i << VADDR_LEVEL_ONE_SHIFT) | (j << VADDR_LEVEL_TWO_SHIFT) | (k << VADDR_LEVEL_THREE_SHIFT);
+                scan_page(as, vaddr, pte);
+            }
+        }
+    }
+}
+
+static void ksm_scanner(void *unused1, unsigned long unused2) {
+    (void)unused1;
+    (void)unused2;
+
+    while (1) {
+        clocksleep(KSM_SCAN_INTERVAL);
+
+        struct timespec start, end, diff;
+        gettime(&start);
+
+        clear_candidates();
+        struct addrspace *held = NULL;
+        struct addrspace *as;
+        uint32_t id = 0;
+        while ((as = as_next_registered(&id)) != NULL) {
+            as->as_scan_next = held;
+            held = as;
+
+            lock_acquire(as->as_lock);
+
+            // Pages being loaded are written through loading_flag
+            if (as->loading_flag == 0) {
+                scan_as(as);
+            }
+
+            lock_release(as->as_lock);
+        }
+
+        /* Translations that allowed writing to now shared frames are
+         * gone, address spaces flush the TLB when they are activated */
+        tlb_flush();
+
+        // The candidates are gone with the scan, so are the references
+        while (held != NULL) {
+            as = held;
+            held = as->as_scan_next;
+            as_put(as);
+        }
+
+        gettime(&end);
+        timespec_sub(&end, &start, &diff);
+
+        lock_acquire(ksm_lock);
+        stats.passes++;
+        stats.scan_ns += (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+        lock_release(ksm_lock);
+    }
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 interface functions                //
+////////////////////////////////////////////////////////
+
+void ksm_bootstrap() {
+    if ((ksm_lock = lock_create("ksm_lock")) == NULL) {
+        panic("Insufficient memory for same-page merging\n");
+    }
+    for (int i = 0; i < KSM_BUCKETS; i++) {
+        by_hash[i] = NULL;
+        by_frame[i] = NULL;
+    }
+    bzero(&stats, sizeof(stats));
+
+    if (thread_fork("ksm scanner", kproc, ksm_scanner, NULL, 0) != 0) {
+        panic("Cannot start same-page merging scanner\n");
+    }
+}
+
+// Print the statistics, for the kernel menu
+void ksm_print() {
+    lock_acquire(ksm_lock);
+    kprintf("ksm: %llu passes, %llu pages scanned, %llu merged, %llu cow breaks\n",
+            (unsigned long long)stats.passes, (unsigned long long)stats.pages_scanned,
+            (unsigned long long)stats.pages_merged, (unsigned long long)stats.cow_breaks);
+    kprintf("ksm: %u shared frames mapped %u times, %llu ns scanning\n",
+            stats.shared_frames, stats.sharers, (unsigned long long)stats.scan_ns);
+    lock_release(ksm_lock);
+}
+
+int sys_ksm_stats(userptr_t buf, int *errno) {
+    struct ksm_stats copy;
+
+    lock_acquire(ksm_lock);
+    copy = stats;
+    lock_release(ksm_lock);
+
+    *errno = copyout(&copy, buf, sizeof(copy));
+    return *errno ? -1 : 0;
+}
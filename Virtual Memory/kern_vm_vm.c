@@ -9,6 +9,12 @@
 #include <spl.h>
 #include <current.h>
 #include <proc.h>
+#include <synch.h>
+#include <kern/mman.h>
+#include <ksm.h>
+#include <zpool.h>
+#include <clock.h>
+#include <ftrace.h>
 
 /* Place your page table functions here */
 
@@ -88,13 +94,298 @@ uint32_t init_pte(struct as_region *fault_region, vaddr_t new_page) {
     return new_pte;
 }
 
-/* Load EntryHi, EntryLo pair into TLB*/
+/* Load EntryHi, EntryLo pair into TLB, replacing the page's old entry if it has one */
 void load_into_tlb(vaddr_t fault_addr, uint32_t pte) {
     int spl = splhigh();
-    tlb_random(fault_addr & TLBHI_VPAGE, pte);
+    int index = tlb_probe(fault_addr & TLBHI_VPAGE, 0);
+    if (index >= 0) {
+        tlb_write(fault_addr & TLBHI_VPAGE, pte & ~PTE_SOFT_MASK, index);
+    } else {
+        tlb_random(fault_addr & TLBHI_VPAGE, pte & ~PTE_SOFT_MASK);
+    }
+    splx(spl);
+}
+
+/* Load the page into a wired TLB slot, dropping any other entry it has */
+static void load_into_wired(unsigned slot, vaddr_t vaddr, uint32_t pte) {
+    int spl = splhigh();
+    int index = tlb_probe(vaddr & TLBHI_VPAGE, 0);
+    if (index >= 0 && (unsigned)index != slot) {
+        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+    }
+    tlb_write(vaddr & TLBHI_VPAGE, pte & ~PTE_SOFT_MASK, slot);
     splx(spl);
 }
 
+/* Return the wired slot holding the page, -1 if it is not wired */
+static int wired_slot(struct addrspace *as, vaddr_t page) {
+    for (int i = 0; i < VM_WIRED_SLOTS; i++) {
+        if (as->as_wired[i] == page) return i;
+    }
+    return -1;
+}
+
+/* Give the page a wired TLB slot, taking the oldest one if all are in
+ * use, and load it if it is resident. Pages wired this way are never
+ * displaced by refaulting ones. Return the slot. Caller holds
+ * as->as_lock.
+ */
+int as_wire_page(struct addrspace *as, vaddr_t vaddr) {
+    vaddr_t page = vaddr & PAGE_FRAME;
+    int slot = wired_slot(as, page);
+
+    if (slot == -1) {
+        slot = wired_slot(as, 0);
+        if (slot == -1) {
+            slot = as->as_wired_next;
+            as->as_wired_next = (as->as_wired_next + 1) % VM_WIRED_SLOTS;
+        }
+        as->as_wired[slot] = page;
+    }
+    as->as_wired_heat[slot] = VM_WIRED_PINNED;
+
+    /* Other address spaces' wired entries are flushed on as_activate,
+     * and an unreferenced page waits for its fault like in as_load_wired */
+    uint32_t pte = page_table_lookup(as, page);
+    if ((pte & TLBLO_VALID) && (pte & PTE_REFERENCED) && as == proc_getas() && as->loading_flag == 0) {
+        load_into_wired(slot, page, pte);
+    }
+
+    return slot;
+}
+
+/* Reload the wired entries of as after a TLB flush. A page whose
+ * reference bit reclaim or trimming has cleared stays out until it
+ * faults and marks itself again, or it would look cold while in use.
+ */
+void as_load_wired(struct addrspace *as) {
+    for (int i = 0; i < VM_WIRED_SLOTS; i++) {
+        if (as->as_wired[i] == 0) continue;
+
+        uint32_t pte = page_table_lookup(as, as->as_wired[i]);
+        if ((pte & TLBLO_VALID) && (pte & PTE_REFERENCED) && as->loading_flag == 0) {
+            load_into_wired(i, as->as_wired[i], pte);
+        }
+    }
+}
+
+/* Count a TLB refill of a resident page, wiring it once it refaults
+ * VM_WIRE_THRESHOLD times and more often than the coldest wired page.
+ * Return 1 if the page went into a wired slot. Caller holds
+ * as->as_lock.
+ */
+static int note_refault(struct addrspace *as, vaddr_t faultaddress, uint32_t pte) {
+    vaddr_t page = faultaddress & PAGE_FRAME;
+
+    /* A wired page refills after a flush, still in use */
+    int slot = wired_slot(as, page);
+    if (slot >= 0) {
+        if (as->as_wired_heat[slot] != VM_WIRED_PINNED) as->as_wired_heat[slot]++;
+        load_into_wired(slot, page, pte);
+        return 1;
+    }
+
+    /* Find the page's counter, or recycle the coldest one */
+    struct as_hot_page *hot = &as->as_hot[0];
+    for (int i = 0; i < VM_HOT_PAGES; i++) {
+        if (as->as_hot[i].vaddr == page) {
+            hot = &as->as_hot[i];
+            break;
+        }
+        if (as->as_hot[i].refaults < hot->refaults) hot = &as->as_hot[i];
+    }
+    if (hot->vaddr != page) {
+        hot->vaddr = page;
+        hot->refaults = 0;
+    }
+
+    if (++hot->refaults < VM_WIRE_THRESHOLD) return 0;
+
+    /* Take a free slot, or the coldest wired page's if this one has
+     * refaulted more. A sweep over more pages than there are slots
+     * would otherwise keep evicting the pages it just wired */
+    slot = wired_slot(as, 0);
+    if (slot == -1) {
+        slot = 0;
+        for (int i = 1; i < VM_WIRED_SLOTS; i++) {
+            if (as->as_wired_heat[i] < as->as_wired_heat[slot]) slot = i;
+        }
+        if (hot->refaults <= as->as_wired_heat[slot]) return 0;
+    }
+
+    as->as_wired[slot] = page;
+    as->as_wired_heat[slot] = hot->refaults;
+    hot->vaddr = 0;
+    hot->refaults = 0;
+    load_into_wired(slot, page, pte);
+    return 1;
+}
+
+/*
+ * Coloured frame allocation.
+ *
+ * Frames are grouped by the cache sets they map to, their colour. A user
+ * page gets a frame of the same colour as its virtual page, so pages
+ * next to each other in a region never collide in a physically indexed
+ * cache. Freed user frames wait on a free list per colour, at most
+ * VM_COLOR_POOL_MAX each, and the rest go back to the kernel.
+ */
+
+static vaddr_t color_free[VM_NCOLORS];      /* Free frames linked through their first word */
+static unsigned color_count[VM_NCOLORS];
+static struct lock *color_lock = NULL;
+
+static vaddr_t color_pop(unsigned color) {
+    vaddr_t frame = color_free[color];
+    if (frame != 0) {
+        color_free[color] = *(vaddr_t *)frame;
+        color_count[color]--;
+    }
+    return frame;
+}
+
+/* Put the frame on its colour's list, 0 if that list is full. Caller holds color_lock */
+static int color_push(vaddr_t frame) {
+    unsigned color = VM_FRAME_COLOR(KVADDR_TO_PADDR(frame));
+    if (color_count[color] >= VM_COLOR_POOL_MAX) return 0;
+
+    *(vaddr_t *)frame = color_free[color];
+    color_free[color] = frame;
+    color_count[color]++;
+    return 1;
+}
+
+/* Allocate a frame for the user page at vaddr, matching its colour when
+ * possible. Return its kernel address, 0 if out of memory.
+ */
+vaddr_t vm_alloc_frame(vaddr_t vaddr) {
+    unsigned color = VM_PAGE_COLOR(vaddr);
+
+    lock_acquire(color_lock);
+    vaddr_t frame = color_pop(color);
+
+    /* Keep frames of other colours for later pages until one matches */
+    for (int i = 0; frame == 0 && i < VM_COLOR_TRIES; i++) {
+        vaddr_t other = alloc_kpages(1);
+        if (other == 0) break;
+        if (VM_FRAME_COLOR(KVADDR_TO_PADDR(other)) == color) {
+            frame = other;
+        } else if (!color_push(other)) {
+            frame = other;      /* Its list is full, take it uncoloured */
+        }
+    }
+
+    /* Out of memory, any colour will do */
+    for (unsigned i = 1; frame == 0 && i < VM_NCOLORS; i++) {
+        frame = color_pop((color + i) % VM_NCOLORS);
+    }
+    lock_release(color_lock);
+
+    return frame;
+}
+
+/* Return a private user frame, by its kernel address */
+void vm_put_frame(vaddr_t frame) {
+    lock_acquire(color_lock);
+    int kept = color_push(frame);
+    lock_release(color_lock);
+
+    if (!kept) free_kpages(frame);
+}
+
+/* Give every frame kept on the colour lists back to the kernel, so
+ * kmalloc can use them under memory pressure. Return how many.
+ */
+unsigned vm_drain_frames(void) {
+    unsigned drained = 0;
+
+    lock_acquire(color_lock);
+    for (int i = 0; i < VM_NCOLORS; i++) {
+        vaddr_t frame;
+        while ((frame = color_pop(i)) != 0) {
+            free_kpages(frame);
+            drained++;
+        }
+    }
+    lock_release(color_lock);
+
+    return drained;
+}
+
+/* Release the frame a pte maps, shared frames go when their last pte does
+ * and compressed pages give back their pool slot.
+ */
+void vm_free_frame(uint32_t pte) {
+    if (pte & PTE_COMPRESSED) {
+        zpool_free(ZPOOL_PTE_SLOT(pte));
+    } else if (pte & PTE_SHARED) {
+        ksm_put_frame(pte & PAGE_FRAME);
+    } else {
+        vm_put_frame(PADDR_TO_KVADDR(pte & PAGE_FRAME));
+    }
+}
+
+/* Unpin the pages covering [vaddr, vaddr + len) */
+void as_unpin_pages(struct addrspace *as, vaddr_t vaddr, size_t len) {
+    if (len == 0) return;
+
+    lock_acquire(as->as_lock);
+    for (vaddr_t page = vaddr & PAGE_FRAME; page < vaddr + len; page += PAGE_SIZE) {
+        uint32_t pte = page_table_lookup(as, page);
+        KASSERT((pte & PTE_PIN_MASK) != 0);
+        insert_into_page_table(as, pte - PTE_PIN_ONE, page);
+    }
+    lock_release(as->as_lock);
+}
+
+/*
+ * Fault in and pin the pages covering [vaddr, vaddr + len) of the
+ * current address space so the kernel can use their frames directly.
+ * write is set if the kernel will store into the pages. The kernel
+ * address of each page's frame goes to kvaddrs.
+ */
+int as_pin_pages(struct addrspace *as, vaddr_t vaddr, size_t len, int write, vaddr_t *kvaddrs) {
+    KASSERT(as == proc_getas());
+
+    int i = 0;
+    vaddr_t page = vaddr & PAGE_FRAME;
+    while (page < vaddr + len) {
+        /* Bytes covered by the pages pinned so far */
+        size_t pinned = page > vaddr ? page - vaddr : 0;
+
+        lock_acquire(as->as_lock);
+        uint32_t pte = page_table_lookup(as, page);
+
+        /* Not in memory yet, or shared and about to be written, fault it in like the user would */
+        if ((pte & TLBLO_VALID) == 0 || (write && (pte & PTE_SHARED))) {
+            lock_release(as->as_lock);
+            int ret = vm_fault(write ? VM_FAULT_WRITE : VM_FAULT_READ, page);
+            if (ret) {
+                as_unpin_pages(as, vaddr, pinned);
+                return ret;
+            }
+            continue;
+        }
+
+        int ret = 0;
+        if (write && (pte & TLBLO_DIRTY) == 0) ret = EFAULT;     /* Read-only page */
+        else if ((pte & PTE_PIN_MASK) == PTE_PIN_MASK) ret = EAGAIN;   /* Pin count is full */
+        if (ret) {
+            lock_release(as->as_lock);
+            as_unpin_pages(as, vaddr, pinned);
+            return ret;
+        }
+
+        insert_into_page_table(as, pte + PTE_PIN_ONE, page);
+        lock_release(as->as_lock);
+
+        kvaddrs[i++] = PADDR_TO_KVADDR(pte & PAGE_FRAME);
+        page += PAGE_SIZE;
+    }
+
+    return 0;
+}
+
 void vm_bootstrap(void)
 {
     /* Initialise any global components of your VM sub-system here.  
@@ -102,8 +393,200 @@ void vm_bootstrap(void)
      * You may or may not need to add anything here depending what's
      * provided or required by the assignment spec.
      */
+    if ((as_registry_lock = lock_create("as_registry_lock")) == NULL) {
+        panic("Insufficient memory for address space registry\n");
+    }
+
+    if ((color_lock = lock_create("color_lock")) == NULL) {
+        panic("Insufficient memory for frame colour lists\n");
+    }
+    for (int i = 0; i < VM_NCOLORS; i++) {
+        color_free[i] = 0;
+        color_count[i] = 0;
+    }
+
+    as_reaper_bootstrap();
+    ftrace_bootstrap();
+    ksm_bootstrap();
+    zpool_bootstrap();
 }
 
+/* Drop the TLB entry of a page of the current address space, if it has one */
+static void tlb_invalidate(vaddr_t vaddr)
+{
+    int spl = splhigh();
+    int index = tlb_probe(vaddr & TLBHI_VPAGE, 0);
+    if (index >= 0) tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+    splx(spl);
+}
+
+/*
+ * Resident set limits.
+ *
+ * An address space at its limit makes room for a new page by
+ * compressing its own cold pages, not by taking frames other processes
+ * could use. Coldness is the PTE_REFERENCED clock vm_reclaim uses, run
+ * over this address space only, from as_trim_hand on. A referenced page
+ * has the bit cleared and its TLB entry dropped, so its next access
+ * faults and marks it again. A page still clear when the hand comes
+ * back is compressed.
+ *
+ * Compressed pages are charged to the address space, and it may hold
+ * no more of them than its limit. Shared, pinned and incompressible
+ * pages cannot be trimmed. If nothing can be, the address space goes
+ * over its limit with frames nobody else needs: the overrun counts, it
+ * leaves trimming alone for VM_TRIM_BACKOFF faults, and it never makes
+ * vm_reclaim compress other processes' pages.
+ */
+
+/* Compress up to want cold pages of the current address space, return
+ * how many frames were freed. Caller holds as->as_lock.
+ */
+static unsigned trim_rss(struct addrspace *as, unsigned want)
+{
+    unsigned freed = 0;
+    uint32_t vpn = as->as_trim_hand;
+    uint32_t travelled = 0;
+
+    /* Twice around, pages referenced on the first visit may go on the second */
+    while (freed < want && travelled < 2 * VM_NPAGES) {
+        uint32_t i = vpn / (VADDR_LEVEL_TWO_SIZE * VADDR_LEVEL_THREE_SIZE);
+        uint32_t j = (vpn / VADDR_LEVEL_THREE_SIZE) % VADDR_LEVEL_TWO_SIZE;
+        uint32_t k = vpn % VADDR_LEVEL_THREE_SIZE;
+        uint32_t next;
+
+        /* Skip missing tables whole */
+        if (as->page_table[i] == NULL) {
+            next = (i + 1) * VADDR_LEVEL_TWO_SIZE * VADDR_LEVEL_THREE_SIZE;
+        } else if (as->page_table[i][j] == NULL) {
+            next = vpn - k + VADDR_LEVEL_THREE_SIZE;
+        } else {
+            next = vpn + 1;
+
+            uint32_t pte = as->page_table[i][j][k];
+            if ((pte & TLBLO_VALID) && (pte & (PTE_SHARED | PTE_PIN_MASK)) == 0) {
+                vaddr_t vaddr = vpn * PAGE_SIZE;
+                tlb_invalidate(vaddr);
+                if (pte & PTE_REFERENCED) {
+                    insert_into_page_table(as, pte & ~PTE_REFERENCED, vaddr);
+                } else {
+                    freed += zpool_evict_page(as, vaddr, pte);
+                }
+            }
+        }
+
+        travelled += next - vpn;
+        vpn = next % VM_NPAGES;
+    }
+
+    as->as_trim_hand = vpn;
+    as->as_trimmed += freed;
+    return freed;
+}
+
+/* Make room for one more resident page of the current address space
+ * within its limit. Caller holds as->as_lock.
+ */
+static void rss_make_room(struct addrspace *as)
+{
+    if (as->as_rss_limit == 0 || as->as_rss < as->as_rss_limit) return;
+
+    /* The last trim found nothing, walking the table again would too */
+    if (as->as_trim_skip > 0) {
+        as->as_trim_skip--;
+        as->as_overruns++;
+        return;
+    }
+
+    if (trim_rss(as, VM_TRIM_BATCH) == 0) as->as_trim_skip = VM_TRIM_BACKOFF;
+    if (as->as_rss >= as->as_rss_limit) as->as_overruns++;
+}
+
+/* Give the page a zeroed frame and map it, handing back the new pte.
+ * Caller holds as->as_lock.
+ */
+static int populate_page(struct addrspace *as, struct as_region *region, vaddr_t page, uint32_t *ret_pte)
+{
+    rss_make_room(as);
+
+    /* Allocate a new page */
+    vaddr_t new_page = vm_alloc_frame(page);    /* This is kernal space address */
+    if (new_page == 0) return ENOMEM;       /* Not enough memory */
+
+    /* Zero out the new page */
+    bzero((void *) new_page, PAGE_SIZE);
+
+    /* Initialize a page of a certain region, new pages start out referenced */
+    uint32_t new_pte = init_pte(region, KVADDR_TO_PADDR(new_page)) | PTE_REFERENCED;
+
+    /* Insert the page table entry into the process's page table */
+    int ret = insert_into_page_table(as, new_pte, page);
+    if (ret) {
+        vm_put_frame(new_page);
+        return ret;
+    }
+    as->as_rss++;
+
+    *ret_pte = new_pte;
+    return 0;
+}
+
+/* Populate up to VM_PREFETCH_PAGES pages following the faulting one in
+ * its region, stopping at the first present page. They are not loaded
+ * into the TLB, the next touch takes the cheap fault path.
+ * Caller holds as->as_lock.
+ */
+static void prefetch_pages(struct addrspace *as, struct as_region *region, vaddr_t faultaddress)
+{
+    vaddr_t page = (faultaddress & PAGE_FRAME) + PAGE_SIZE;
+    for (int i = 0; i < VM_PREFETCH_PAGES && page < region->vtop; i++, page += PAGE_SIZE) {
+        uint32_t pte;
+        if (page_table_lookup(as, page) != 0) break;
+        if (as->as_rss_limit != 0 && as->as_rss >= as->as_rss_limit) break;    /* Never trim for a guess */
+        if (populate_page(as, region, page, &pte)) break;
+    }
+}
+
+/* Map every missing page of [start, end) that lies in a region, for
+ * MADV_WILLNEED. Caller holds as->as_lock.
+ */
+int as_populate_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    for (vaddr_t page = start & PAGE_FRAME; page < end; page += PAGE_SIZE) {
+        struct as_region *region = addr_to_region(as, page);
+        if (region == NULL) continue;
+        if (page_table_lookup(as, page) != 0) continue;    /* Resident or compressed */
+
+        uint32_t pte;
+        int ret = populate_page(as, region, page, &pte);
+        if (ret) return ret;
+    }
+
+    return 0;
+}
+
+/* Free the frames of [start, end) and clear their ptes, for
+ * MADV_DONTNEED. The next touch gets a fresh zeroed page. Pinned pages
+ * are in use by the kernel and are kept. Caller holds as->as_lock.
+ */
+void as_discard_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    for (vaddr_t page = start & PAGE_FRAME; page < end; page += PAGE_SIZE) {
+        uint32_t pte = page_table_lookup(as, page);
+        if (pte == 0 || (pte & PTE_PIN_MASK) != 0) continue;
+
+        if (pte & TLBLO_VALID) as->as_rss--;
+        if (pte & PTE_COMPRESSED) as->as_zslots--;
+        vm_free_frame(pte);
+        insert_into_page_table(as, 0, page);
+    }
+
+    /* Stale translations may still point at the freed frames */
+    tlb_flush();
+}
+
+static int handle_fault(struct addrspace *as, int faulttype, vaddr_t faultaddress, int *outcome);
+
 // TLB exception handler
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
@@ -111,8 +594,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
     struct addrspace *as;
 
     switch (faulttype) {
-	    case VM_FAULT_READONLY:             // Write to Read-only page
-            return EFAULT;
+	    case VM_FAULT_READONLY:             // Write to Read-only page, unless it is shared
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -129,18 +611,103 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
+    /* Only a traced fault pays for the clock reads and the region lookup */
+    int tracing = ftrace_enabled;
+    struct timespec start;
+    if (tracing) gettime(&start);
+    int outcome = FTRACE_REFILL;
+
+    /* Page table entries change under the as lock */
+    lock_acquire(as->as_lock);
+    int ret = handle_fault(as, faulttype, faultaddress, &outcome);
+
+    /* Out of memory, finish pending reaping, hand the colour lists back
+     * for kmalloc, or compress cold pages, and retry. Reclaim takes
+     * every as lock, drop ours. A process over its limit does not get
+     * to compress other processes' pages.
+     */
+    while (ret == ENOMEM) {
+        int over_limit = as->as_rss_limit != 0 && as->as_rss >= as->as_rss_limit;
+        lock_release(as->as_lock);
+        if (as_reap_now() == 0 && vm_drain_frames() == 0 &&
+            (over_limit || vm_reclaim(ZPOOL_RECLAIM_BATCH) == 0)) {
+            if (tracing) ftrace_record(as->as_id, 0, faulttype, faultaddress, FTRACE_ENOMEM, &start);
+            return ENOMEM;
+        }
+        lock_acquire(as->as_lock);
+        ret = handle_fault(as, faulttype, faultaddress, &outcome);
+    }
+
+    vaddr_t region_base = 0;
+    if (tracing) {
+        struct as_region *region = addr_to_region(as, faultaddress);
+        if (region != NULL) region_base = region->vbase;
+    }
+    lock_release(as->as_lock);
+
+    if (tracing) ftrace_record(as->as_id, region_base, faulttype, faultaddress, outcome, &start);
+
+    return ret;
+}
+
+/* Resolve a fault on a page of as, telling how in outcome (FTRACE_*).
+ * Caller holds as->as_lock.
+ */
+static int handle_fault(struct addrspace *as, int faulttype, vaddr_t faultaddress, int *outcome)
+{
     uint32_t pte = page_table_lookup(as, faultaddress);
 
     /* If the page exists in memory */
     if (pte & TLBLO_VALID) {
+        int pte_shared = (pte & PTE_SHARED) != 0;
+
+        /* A merged page is never writable, a write takes a private copy */
+        if (pte_shared) {
+            if (faulttype == VM_FAULT_READ) {
+                load_into_tlb(faultaddress, pte);
+                *outcome = FTRACE_REFILL;
+                return 0;
+            }
+
+            struct as_region *region = addr_to_region(as, faultaddress);
+            *outcome = FTRACE_BADADDR;
+            if (region == NULL) return EFAULT;
+            *outcome = FTRACE_READONLY;
+            if (region->writeable == 0 && as->loading_flag == 0) return EFAULT;
+
+            *outcome = FTRACE_ENOMEM;
+            int ret = ksm_unshare(as, faultaddress, region->writeable, &pte);
+            if (ret) return ret;
+        }
+
+        /* Write to a page that was read-only in the TLB */
+        if (faulttype == VM_FAULT_READONLY && (pte & TLBLO_DIRTY) == 0 && as->loading_flag == 0) {
+            *outcome = FTRACE_READONLY;
+            return EFAULT;
+        }
 
         /* Check write permission */
         if ((faulttype == VM_FAULT_WRITE) && ((pte & TLBLO_DIRTY) == 0) && (as->loading_flag == 0)) {
+            *outcome = FTRACE_READONLY;
             return EFAULT;  /* Write to read-only page */
         }
 
-        /* Load the mapping to TLB, if loading_flag is set, write is allowed */
-        load_into_tlb(faultaddress, pte | as->loading_flag);
+        /* In use, reclaim leaves it alone for another pass */
+        if ((pte & PTE_REFERENCED) == 0) {
+            pte |= PTE_REFERENCED;
+            insert_into_page_table(as, pte, faultaddress);
+        }
+
+        /* Hot pages go to a wired slot, others to the TLB at random. If
+         * loading_flag is set, write is allowed.
+         */
+        int wired = as->loading_flag == 0 && note_refault(as, faultaddress, pte);
+        if (!wired) {
+            load_into_tlb(faultaddress, pte | as->loading_flag);
+        }
+
+        if (pte_shared) *outcome = FTRACE_COW;
+        else *outcome = wired ? FTRACE_WIRED : FTRACE_REFILL;
 
         /* Return 0 on success */
         return 0;
@@ -148,34 +715,47 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
     /* If no valid translation, allocate new page */
     struct as_region *fault_region = addr_to_region(as, faultaddress);
+    *outcome = FTRACE_BADADDR;
     if (fault_region == NULL) return EFAULT;    /* Region not exist, bad memory reference */
 
     /* Check write permission */
+    *outcome = FTRACE_READONLY;
     if ((faulttype == VM_FAULT_WRITE) && (fault_region->writeable == 0) && (as->loading_flag == 0)) {
         return EFAULT;  /* Write to read-only page */
     }
 
-    /* Allocate a new page */
-    vaddr_t new_page = alloc_kpages(1);     /* This is kernal space address */
-    if (new_page == 0) return ENOMEM;       /* Not enough memory */
+    /* Compressed under memory pressure, expand it into a new frame */
+    *outcome = FTRACE_ENOMEM;
+    if (pte & PTE_COMPRESSED) {
+        rss_make_room(as);
 
-    /* Zero out the new page */
-    bzero((void *) new_page, 4096);
-    
-    /* Initialize a page of a certain region */
-    uint32_t new_pte = init_pte(fault_region, KVADDR_TO_PADDR(new_page));
-
-    /* Insert the page table entry into the process's page table */
-    int ret = insert_into_page_table(as, new_pte, faultaddress);
+        vaddr_t new_page = vm_alloc_frame(faultaddress);
+        if (new_page == 0) return ENOMEM;
 
-    if (ret) {
-        free_kpages(new_page);
+        zpool_load(ZPOOL_PTE_SLOT(pte), new_page);
+        as->as_zslots--;
+        pte = init_pte(fault_region, KVADDR_TO_PADDR(new_page)) | PTE_REFERENCED;
+        insert_into_page_table(as, pte, faultaddress);
+        as->as_rss++;
 
-        return ret;
+        load_into_tlb(faultaddress, pte | as->loading_flag);
+        *outcome = FTRACE_DECOMPRESS;
+        return 0;
     }
 
+    /* Allocate a new page */
+    uint32_t new_pte;
+    int ret = populate_page(as, fault_region, faultaddress, &new_pte);
+    if (ret) return ret;
+
     /* Load the mapping to TLB */
     load_into_tlb(faultaddress, new_pte | as->loading_flag);
+    *outcome = FTRACE_ZERO_PAGE;
+
+    /* Read ahead in regions that are walked in order */
+    if (fault_region->advice == MADV_SEQUENTIAL) {
+        prefetch_pages(as, fault_region, faultaddress);
+    }
 
     /* Success */
     return 0;
@@ -0,0 +1,483 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/zpool.h>
+#include <lib.h>
+#include <synch.h>
+#include <clock.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <mips/tlb.h>
+#include <zpool.h>
+
+/*
+ * Compressed page store.
+ *
+ * When a fault cannot get a frame, vm_reclaim compresses cold pages of
+ * every address space into the pool and frees their frames. The pool
+ * stores them in chunks of ZPOOL_PAGES frames it takes at bootstrap, so
+ * storing never needs memory at the moment memory has run out.
+ * Their ptes lose TLBLO_VALID and keep PTE_COMPRESSED and the slot
+ * number instead, and the next touch decompresses the page into a new
+ * frame.
+ *
+ * Coldness is a second chance clock: the fault handler sets
+ * PTE_REFERENCED whenever it loads a page into the TLB, and the reclaim
+ * hand clears it. The hand keeps its place across calls, going through
+ * the registry one address space after another, so a page is only
+ * compressed if it stayed clear for a whole trip around. Since the TLB
+ * is flushed after each call, pages in use fault once and get marked
+ * again. A call whose trip freed nothing goes round once more, so
+ * memory that is all freshly referenced can still be reclaimed.
+ *
+ * Pages compress with a small LZ77 variant: groups of eight items, each
+ * group led by a byte whose bits mark matches. A match is two bytes, a
+ * 4-bit length (3 to 18) and a 12-bit distance back into the page.
+ */
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                    compressor                      //
+////////////////////////////////////////////////////////
+
+#define LZ_HASH_SIZE    4096
+#define LZ_MIN_MATCH    3
+#define LZ_MAX_MATCH    18
+#define LZ_MAX_DIST     4095
+
+static uint16_t lz_table[LZ_HASH_SIZE];     // Last position + 1 of each 3-byte hash, guarded by zpool_lock
+
+static unsigned lz_hash(const uint8_t *p) {
+    return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) % LZ_HASH_SIZE;
+}
+
+/* Compress a page into dst, return the compressed length, 0 if it does
+ * not fit in max bytes. Caller holds zpool_lock.
+ */
+static size_t lz_compress(const uint8_t *src, uint8_t *dst, size_t max) {
+    size_t i = 0, o = 0;
+    bzero(lz_table, sizeof(lz_table));
+
+    while (i < PAGE_SIZE) {
+        if (o + 1 > max) return 0;
+        size_t ctrl_pos = o++;
+        uint8_t ctrl = 0;
+
+        for (int bit = 0; bit < 8 && i < PAGE_SIZE; bit++) {
+            if (i + LZ_MIN_MATCH <= PAGE_SIZE) {
+                unsigned h = lz_hash(&src[i]);
+                size_t cand = lz_table[h];
+                lz_table[h] = i + 1;
+
+                // Matches stay inside the page and within reach of 12 bits
+                if (cand != 0 && i - (cand - 1) <= LZ_MAX_DIST &&
+                    memcmp(&src[cand - 1], &src[i], LZ_MIN_MATCH) == 0) {
+                    size_t from = cand - 1;
+                    size_t len = LZ_MIN_MATCH;
+                    while (len < LZ_MAX_MATCH && i + len < PAGE_SIZE && src[from + len] == src[i + len]) len++;
+
+                    if (o + 2 > max) return 0;
+                    size_t dist = i - from;
+                    dst[o++] = ((len - LZ_MIN_MATCH) << 4) | (dist >> 8);
+                    dst[o++] = dist & 0xff;
+                    ctrl |= 1 << bit;
+                    i += len;
+                    continue;
+                }
+            }
+
+            if (o + 1 > max) return 0;
+            dst[o++] = src[i++];
+        }
+
+        dst[ctrl_pos] = ctrl;
+    }
+
+    return o;
+}
+
+// Expand len bytes of compressed data back into a page
+static void lz_decompress(const uint8_t *src, size_t len, uint8_t *dst) {
+    size_t i = 0, o = 0;
+
+    while (i < len) {
+        uint8_t ctrl = src[i++];
+        for (int bit = 0; bit < 8 && i < len; bit++) {
+            if (ctrl & (1 << bit)) {
+                size_t match = (src[i] >> 4) + LZ_MIN_MATCH;
+                size_t dist = ((src[i] & 0x0f) << 8) | src[i + 1];
+                i += 2;
+                // Byte by byte, a match may overlap what it produces
+                for (size_t k = 0; k < match; k++, o++) dst[o] = dst[o - dist];
+            } else {
+                dst[o++] = src[i++];
+            }
+        }
+    }
+
+    KASSERT(o == PAGE_SIZE);
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                     slot pool                      //
+////////////////////////////////////////////////////////
+
+struct zslot {
+    int         chunk;      // First chunk of the data, -1 if the slot is free
+    size_t      len;
+};
+
+static vaddr_t pool_pages[ZPOOL_PAGES];    // Storage owned by the pool
+static int16_t chunk_next[ZPOOL_CHUNKS];    // Next chunk of the same slot, or of the free list
+static int free_chunk = -1;                 // Head of the free chunk list
+static unsigned free_chunks = 0;
+
+static struct zslot slots[ZPOOL_MAX_SLOTS];
+static int next_free_slot = 0;              // Lowest slot that may be free
+static struct lock *zpool_lock = NULL;      // Guards the slots, chunks, compressor and stats
+static struct zpool_stats stats;
+static uint8_t scratch[ZPOOL_MAX_STORED];   // Compressor output, guarded by zpool_lock
+
+static uint8_t *chunk_addr(int chunk) {
+    return (uint8_t *)pool_pages[chunk / (PAGE_SIZE / ZPOOL_CHUNK_SIZE)] +
+           (chunk % (PAGE_SIZE / ZPOOL_CHUNK_SIZE)) * ZPOOL_CHUNK_SIZE;
+}
+
+// Return a free slot, -1 if the pool is full. Caller holds zpool_lock
+static int alloc_slot(void) {
+    for (int i = next_free_slot; i < ZPOOL_MAX_SLOTS; i++) {
+        if (slots[i].chunk == -1) {
+            next_free_slot = i + 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Copy len bytes into a new slot and return it, -1 if there is no free
+ * slot or not enough free chunks. Caller holds zpool_lock.
+ */
+static int store_data(const uint8_t *data, size_t len) {
+    unsigned need = (len + ZPOOL_CHUNK_SIZE - 1) / ZPOOL_CHUNK_SIZE;
+    if (need > free_chunks) return -1;
+
+    int slot = alloc_slot();
+    if (slot == -1) return -1;
+
+    // Take chunks off the free list in order, they already form a chain
+    int first = free_chunk;
+    int chunk = first;
+    for (unsigned n = 0; n < need; n++) {
+        size_t part = len < ZPOOL_CHUNK_SIZE ? len : ZPOOL_CHUNK_SIZE;
+        memcpy(chunk_addr(chunk), data, part);
+        data += part;
+        len -= part;
+
+        if (n + 1 == need) {
+            free_chunk = chunk_next[chunk];
+            chunk_next[chunk] = -1;
+        } else {
+            chunk = chunk_next[chunk];
+        }
+    }
+    free_chunks -= need;
+
+    slots[slot].chunk = first;
+    return slot;
+}
+
+// Copy the slot's data out into dst. Caller holds zpool_lock
+static void gather_data(int slot, uint8_t *dst) {
+    size_t len = slots[slot].len;
+    for (int chunk = slots[slot].chunk; chunk != -1; chunk = chunk_next[chunk]) {
+        size_t part = len < ZPOOL_CHUNK_SIZE ? len : ZPOOL_CHUNK_SIZE;
+        memcpy(dst, chunk_addr(chunk), part);
+        dst += part;
+        len -= part;
+    }
+}
+
+// Caller holds zpool_lock
+static void release_slot(int slot) {
+    stats.stored_pages--;
+    stats.stored_bytes -= slots[slot].len;
+
+    int chunk = slots[slot].chunk;
+    while (chunk != -1) {
+        int next = chunk_next[chunk];
+        chunk_next[chunk] = free_chunk;
+        free_chunk = chunk;
+        free_chunks++;
+        chunk = next;
+    }
+
+    slots[slot].chunk = -1;
+    if (slot < next_free_slot) next_free_slot = slot;
+}
+
+void zpool_bootstrap() {
+    if ((zpool_lock = lock_create("zpool_lock")) == NULL) {
+        panic("Insufficient memory for compressed page store\n");
+    }
+    for (int i = 0; i < ZPOOL_PAGES; i++) {
+        if ((pool_pages[i] = alloc_kpages(1)) == 0) {
+            panic("Insufficient memory for compressed page store\n");
+        }
+    }
+    for (int i = ZPOOL_CHUNKS - 1; i >= 0; i--) {
+        chunk_next[i] = free_chunk;
+        free_chunk = i;
+    }
+    free_chunks = ZPOOL_CHUNKS;
+    for (int i = 0; i < ZPOOL_MAX_SLOTS; i++) slots[i].chunk = -1;
+    bzero(&stats, sizeof(stats));
+}
+
+/* Compress the page into a new slot and return it, -1 if the page does
+ * not compress well enough or the pool is full.
+ */
+int zpool_store(vaddr_t page) {
+    lock_acquire(zpool_lock);
+
+    size_t len = lz_compress((const uint8_t *)page, scratch, ZPOOL_MAX_STORED);
+    if (len == 0) {
+        stats.incompressible++;
+        lock_release(zpool_lock);
+        return -1;
+    }
+
+    int slot = store_data(scratch, len);
+    if (slot == -1) {
+        stats.store_failures++;
+        lock_release(zpool_lock);
+        return -1;
+    }
+    slots[slot].len = len;
+
+    stats.compressed++;
+    stats.stored_pages++;
+    stats.stored_bytes += len;
+
+    lock_release(zpool_lock);
+    return slot;
+}
+
+// Decompress the slot into the page and free the slot
+void zpool_load(int slot, vaddr_t page) {
+    struct timespec start, end, diff;
+    gettime(&start);
+
+    lock_acquire(zpool_lock);
+    KASSERT(slots[slot].chunk != -1);
+    gather_data(slot, scratch);
+    lz_decompress(scratch, slots[slot].len, (uint8_t *)page);
+    release_slot(slot);
+
+    gettime(&end);
+    timespec_sub(&end, &start, &diff);
+    stats.decompressed++;
+    stats.decompress_ns += (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+    lock_release(zpool_lock);
+}
+
+// Copy the slot for as_copy, return the new slot, -1 if the pool is full
+int zpool_dup(int slot) {
+    lock_acquire(zpool_lock);
+
+    gather_data(slot, scratch);
+    int copy = store_data(scratch, slots[slot].len);
+    if (copy == -1) {
+        stats.store_failures++;
+        lock_release(zpool_lock);
+        return -1;
+    }
+    slots[copy].len = slots[slot].len;
+    stats.stored_pages++;
+    stats.stored_bytes += slots[copy].len;
+
+    lock_release(zpool_lock);
+    return copy;
+}
+
+void zpool_free(int slot) {
+    lock_acquire(zpool_lock);
+    release_slot(slot);
+    lock_release(zpool_lock);
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                      reclaim                       //
+////////////////////////////////////////////////////////
+
+/* Compress the private resident page at vaddr and free its frame,
+ * charging the slot to as. 1 if the frame was freed. Its TLB entry is
+ * left to the caller. Caller holds as->as_lock.
+ */
+int zpool_evict_page(struct addrspace *as, vaddr_t vaddr, uint32_t pte) {
+    // A limited address space holds no more compressed pages than resident ones
+    if (as->as_rss_limit != 0 && as->as_zslots >= as->as_rss_limit) return 0;
+
+    vaddr_t page = PADDR_TO_KVADDR(pte & PAGE_FRAME);
+    int slot = zpool_store(page);
+    if (slot == -1) return 0;
+
+    insert_into_page_table(as, ZPOOL_SLOT_PTE(slot) | PTE_COMPRESSED, vaddr);
+    vm_put_frame(page);
+    as->as_rss--;
+    as->as_zslots++;
+    return 1;
+}
+
+/* Give a referenced page its second chance, or compress a cold one and
+ * free its frame. 1 if a frame was freed. Caller holds as->as_lock.
+ */
+static int reclaim_page(struct addrspace *as, vaddr_t vaddr, uint32_t pte) {
+    if (pte & PTE_REFERENCED) {
+        insert_into_page_table(as, pte & ~PTE_REFERENCED, vaddr);
+        return 0;
+    }
+
+    return zpool_evict_page(as, vaddr, pte);
+}
+
+// Where the reclaim hand is, guarded by as_registry_lock
+static uint32_t hand_as = 0;        // as_id of the address space
+static uint32_t hand_vpn = 0;       // Next page it looks at
+
+/* Move *vpn towards end through the address space until want frames
+ * are freed, return how many were. Caller holds as->as_lock.
+ */
+static unsigned sweep(struct addrspace *as, uint32_t *vpn, uint32_t end, unsigned want) {
+    unsigned freed = 0;
+
+    while (*vpn < end && freed < want) {
+        uint32_t i = *vpn / (VADDR_LEVEL_TWO_SIZE * VADDR_LEVEL_THREE_SIZE);
+        uint32_t j = (*vpn / VADDR_LEVEL_THREE_SIZE) % VADDR_LEVEL_TWO_SIZE;
+        uint32_t k = *vpn % VADDR_LEVEL_THREE_SIZE;
+
+        // Skip missing tables whole
+        if (as->page_table[i] == NULL) {
+            *vpn = (i + 1) * VADDR_LEVEL_TWO_SIZE * VADDR_LEVEL_THREE_SIZE;
+            continue;
+        }
+        if (as->page_table[i][j] == NULL) {
+            *vpn = *vpn - k + VADDR_LEVEL_THREE_SIZE;
+            continue;
+        }
+
+        uint32_t pte = as->page_table[i][j][k];
+        vaddr_t vaddr = *vpn * PAGE_SIZE;
+        (*vpn)++;
+
+        // Only private pages nobody has pinned
+        if ((pte & TLBLO_VALID) == 0 || (pte & (PTE_SHARED | PTE_PIN_MASK)) != 0) continue;
+
+        freed += reclaim_page(as, vaddr, pte);
+    }
+
+    return freed;
+}
+
+/* Move the hand once around the registry from where it stopped until
+ * want frames are freed, return how many were. Caller holds
+ * as_registry_lock.
+ */
+static unsigned trip(unsigned want) {
+    unsigned freed = 0;
+
+    // Carry on from the hand, or the address space after it if that one is gone
+    struct addrspace *start = as_registry;
+    uint32_t start_vpn = 0;
+    for (struct addrspace *as = as_registry; as != NULL; as = as->as_next) {
+        if (as->as_id <= hand_as) {
+            start = as;
+            if (as->as_id == hand_as) start_vpn = hand_vpn;
+            break;
+        }
+    }
+
+    struct addrspace *as = start;
+    uint32_t vpn = start_vpn;
+    int wrapped = 0;
+    while (as != NULL && freed < want) {
+        // Back at the start, only the pages before the hand are left
+        uint32_t end = wrapped ? start_vpn : VM_NPAGES;
+
+        lock_acquire(as->as_lock);
+        freed += sweep(as, &vpn, end, want - freed);
+        lock_release(as->as_lock);
+
+        if (freed >= want || wrapped) break;
+
+        as = as->as_next != NULL ? as->as_next : as_registry;
+        vpn = 0;
+        if (as == start) wrapped = 1;
+    }
+
+    if (as != NULL) {
+        hand_as = as->as_id;
+        hand_vpn = vpn;
+    }
+
+    return freed;
+}
+
+/* Free up to want frames by compressing cold pages, return how many
+ * were freed. The first trip of the hand may only clear reference bits,
+ * every resident page is referenced once faulted in, so if it frees
+ * nothing the hand goes round a second time. Caller holds no as lock.
+ */
+int vm_reclaim(unsigned want) {
+    lock_acquire(as_registry_lock);
+
+    unsigned freed = trip(want);
+    if (freed == 0) {
+        // Pages used since their bit was cleared have to fault to say so
+        tlb_flush();
+        freed = trip(want);
+    }
+
+    // Drop translations of compressed pages and let used pages mark themselves again
+    tlb_flush();
+
+    lock_release(as_registry_lock);
+
+    lock_acquire(zpool_lock);
+    stats.reclaims++;
+    lock_release(zpool_lock);
+
+    return freed;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 interface functions                //
+////////////////////////////////////////////////////////
+
+// Print the statistics, for the kernel menu
+void zpool_print() {
+    lock_acquire(zpool_lock);
+    kprintf("zpool: %u pages in %u bytes, %llu compressed, %llu incompressible, %llu did not fit\n",
+            stats.stored_pages, stats.stored_bytes,
+            (unsigned long long)stats.compressed, (unsigned long long)stats.incompressible,
+            (unsigned long long)stats.store_failures);
+    kprintf("zpool: %llu decompressed, avg %llu ns, %llu reclaim passes\n",
+            (unsigned long long)stats.decompressed,
+            (unsigned long long)(stats.decompressed ? stats.decompress_ns / stats.decompressed : 0),
+            (unsigned long long)stats.reclaims);
+    lock_release(zpool_lock);
+}
+
+int sys_zpool_stats(userptr_t buf, int *errno) {
+    struct zpool_stats copy;
+
+    lock_acquire(zpool_lock);
+    copy = stats;
+    lock_release(zpool_lock);
+
+    *errno = copyout(&copy, buf, sizeof(copy));
+    return *errno ? -1 : 0;
+}
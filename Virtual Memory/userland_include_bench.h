@@ -0,0 +1,60 @@
+/*
+ * Timing harness shared by the benchmark programs in testbin.
+ *
+ * Every benchmark is run several times and reported as one line of
+ * key=value fields, prefixed by the suite name:
+ *
+ *   vmbench touch_seq runs=5 ops=128 min_ns=... med_ns=... max_ns=... ns_per_op=... base_ns=... delta=+2% ok
+ *
+ * The last field is "ok", "regressed" if the median is more than the
+ * threshold slower than the baseline, or "new" without a baseline.
+ * Metrics that are not times are reported as
+ *
+ *   vmbench ksm_frames_reclaimed value=... unit=frames
+ *
+ * A baseline file holds one "name med_ns" line per benchmark.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <sys/types.h>
+
+#define BENCH_MAX_RUNS      32      /* Samples kept per benchmark */
+#define BENCH_DEFAULT_RUNS  5
+#define BENCH_MAX_BASELINE  64      /* Benchmarks a baseline file can hold */
+#define BENCH_NAME_MAX      32
+#define BENCH_THRESHOLD     10      /* Percent slower than the baseline that counts as a regression */
+
+/* Nanoseconds from an arbitrary start */
+uint64_t bench_now(void);
+
+/*
+ * Parse the common options and return the index of the first other
+ * argument, which name the benchmarks to run (all if there are none):
+ *   -r runs    samples per benchmark
+ *   -b file    compare against the baseline in file
+ *   -s file    write the medians to file as the new baseline
+ *   -t pct     regression threshold in percent
+ */
+int bench_init(const char *suite, int argc, char **argv);
+int bench_selected(const char *name);
+unsigned bench_runs(void);
+
+/* Time fn runs times. fn returns the nanoseconds it measured itself, so
+ * setup it does before or after does not count. ops is the work done
+ * by one run, for ns_per_op.
+ */
+void bench_run(const char *name, unsigned long ops, uint64_t (*fn)(void *), void *arg);
+
+/* Report samples measured elsewhere, for example by a child process */
+void bench_record(const char *name, unsigned long ops, uint64_t *samples, unsigned runs);
+
+void bench_metric(const char *name, uint64_t value, const char *unit);
+
+/* Write the baseline if asked, print the summary and return the number
+ * of regressions, to be used as the exit status.
+ */
+int bench_finish(void);
+
+#endif /* _BENCH_H_ */
@@ -0,0 +1,202 @@
+/*
+ * Timing harness for the benchmark programs, see bench.h.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <bench.h>
+
+struct bench_entry {
+    char        name[BENCH_NAME_MAX];
+    uint64_t    med_ns;
+};
+
+static const char *suite_name = "bench";
+static unsigned runs = BENCH_DEFAULT_RUNS;
+static unsigned threshold = BENCH_THRESHOLD;
+static const char *save_path = NULL;
+
+static char **selected = NULL;      // Benchmarks named on the command line
+static int num_selected = 0;
+
+static struct bench_entry baseline[BENCH_MAX_BASELINE];
+static unsigned num_baseline = 0;
+static struct bench_entry results[BENCH_MAX_BASELINE];
+static unsigned num_results = 0;
+static unsigned regressions = 0;
+
+uint64_t bench_now(void) {
+    time_t secs;
+    unsigned long nsecs;
+    __time(&secs, &nsecs);
+    return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                  baseline files                    //
+////////////////////////////////////////////////////////
+
+static char file_buf[BENCH_MAX_BASELINE * (BENCH_NAME_MAX + 24)];
+
+static void load_baseline(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) err(1, "%s", path);
+
+    ssize_t len = 0, n;
+    while ((n = read(fd, file_buf + len, sizeof(file_buf) - 1 - len)) > 0) len += n;
+    if (n < 0) err(1, "%s: read", path);
+    close(fd);
+    file_buf[len] = '\0';
+
+    // One "name med_ns" per line
+    char *line = file_buf;
+    while (*line != '\0' && num_baseline < BENCH_MAX_BASELINE) {
+        char *end = strchr(line, '\n');
+        if (end != NULL) *end = '\0';
+
+        char *space = strchr(line, ' ');
+        if (space != NULL && space - line < BENCH_NAME_MAX) {
+            struct bench_entry *entry = &baseline[num_baseline++];
+            memcpy(entry->name, line, space - line);
+            entry->name[space - line] = '\0';
+            entry->med_ns = 0;
+            for (char *p = space + 1; *p >= '0' && *p <= '9'; p++) entry->med_ns = entry->med_ns * 10 + (*p - '0');
+        }
+
+        if (end == NULL) break;
+        line = end + 1;
+    }
+}
+
+static void save_baseline(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+    if (fd < 0) err(1, "%s", path);
+
+    for (unsigned i = 0; i < num_results; i++) {
+        char line[BENCH_NAME_MAX + 24];
+        int len = snprintf(line, sizeof(line), "%s %llu\n", results[i].name, (unsigned long long)results[i].med_ns);
+        if (write(fd, line, len) != len) err(1, "%s: write", path);
+    }
+    close(fd);
+}
+
+// Return the baseline median of the benchmark, 0 if there is none
+static uint64_t baseline_of(const char *name) {
+    for (unsigned i = 0; i < num_baseline; i++) {
+        if (strcmp(baseline[i].name, name) == 0) return baseline[i].med_ns;
+    }
+    return 0;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 interface functions                //
+////////////////////////////////////////////////////////
+
+int bench_init(const char *suite, int argc, char **argv) {
+    suite_name = suite;
+
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (i + 1 == argc || argv[i][2] != '\0') errx(1, "usage: %s [-r runs] [-b baseline] [-s baseline] [-t pct] [benchmark...]", suite);
+
+        switch (argv[i][1]) {
+            case 'r':
+                runs = atoi(argv[++i]);
+                if (runs == 0 || runs > BENCH_MAX_RUNS) errx(1, "runs must be 1 to %d", BENCH_MAX_RUNS);
+                break;
+            case 'b':
+                load_baseline(argv[++i]);
+                break;
+            case 's':
+                save_path = argv[++i];
+                break;
+            case 't':
+                threshold = atoi(argv[++i]);
+                break;
+            default:
+                errx(1, "unknown option %s", argv[i]);
+        }
+    }
+
+    selected = &argv[i];
+    num_selected = argc - i;
+    return i;
+}
+
+// 1 if the benchmark should run
+int bench_selected(const char *name) {
+    if (num_selected == 0) return 1;
+    for (int i = 0; i < num_selected; i++) {
+        if (strcmp(selected[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+unsigned bench_runs(void) {
+    return runs;
+}
+
+void bench_record(const char *name, unsigned long ops, uint64_t *samples, unsigned n) {
+    // Insertion sort for the median
+    for (unsigned i = 1; i < n; i++) {
+        uint64_t s = samples[i];
+        unsigned j = i;
+        while (j > 0 && samples[j - 1] > s) {
+            samples[j] = samples[j - 1];
+            j--;
+        }
+        samples[j] = s;
+    }
+
+    uint64_t med = samples[n / 2];
+    printf("%s %s runs=%u ops=%lu min_ns=%llu med_ns=%llu max_ns=%llu ns_per_op=%llu",
+           suite_name, name, n, ops, (unsigned long long)samples[0], (unsigned long long)med,
+           (unsigned long long)samples[n - 1], (unsigned long long)(ops ? med / ops : med));
+
+    uint64_t base = baseline_of(name);
+    if (base == 0) {
+        printf(" base_ns=0 delta=0%% new\n");
+    } else {
+        int delta = (int)(((int64_t)med - (int64_t)base) * 100 / (int64_t)base);
+        int regressed = delta > (int)threshold;
+        printf(" base_ns=%llu delta=%+d%% %s\n", (unsigned long long)base, delta, regressed ? "regressed" : "ok");
+        regressions += regressed;
+    }
+
+    if (num_results < BENCH_MAX_BASELINE) {
+        struct bench_entry *entry = &results[num_results++];
+        size_t len = strlen(name);
+        if (len >= BENCH_NAME_MAX) len = BENCH_NAME_MAX - 1;
+        memcpy(entry->name, name, len);
+        entry->name[len] = '\0';
+        entry->med_ns = med;
+    }
+}
+
+void bench_run(const char *name, unsigned long ops, uint64_t (*fn)(void *), void *arg) {
+    uint64_t samples[BENCH_MAX_RUNS];
+
+    if (!bench_selected(name)) return;
+
+    for (unsigned i = 0; i < runs; i++) {
+        samples[i] = fn(arg);
+    }
+    bench_record(name, ops, samples, runs);
+}
+
+void bench_metric(const char *name, uint64_t value, const char *unit) {
+    printf("%s %s value=%llu unit=%s\n", suite_name, name, (unsigned long long)value, unit);
+}
+
+int bench_finish(void) {
+    if (save_path != NULL) save_baseline(save_path);
+    printf("%s summary benchmarks=%u regressions=%u\n", suite_name, num_results, regressions);
+    return regressions;
+}
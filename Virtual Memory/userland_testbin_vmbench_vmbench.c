@@ -0,0 +1,368 @@
+/*
+ * vmbench - benchmarks for the VM subsystem.
+ *
+ * Covers the fault paths (first touch in order and at random, TLB
+ * refills over more pages than the TLB holds, sparse touches that build
+ * page tables), fork of a process with a large resident set, exec/exit
+ * churn and stack growth, plus same-page merging, the compressed page
+ * pool and page colouring, and a tenant running next to a memory hog
+ * held to its resident set limit.
+ *
+ * Usage: vmbench [-r runs] [-b baseline] [-s baseline] [-t pct] [benchmark...]
+ * Output and baseline format are described in bench.h. The exit status
+ * is the number of benchmarks slower than the baseline.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <kern/mman.h>
+#include <kern/ksm.h>
+#include <kern/zpool.h>
+#include <kern/rss.h>
+#include <bench.h>
+
+/* System calls added by this tree, stubs are generated from kern/syscall.h */
+int madvise(void *addr, size_t len, int advice);
+int ksm_stats(struct ksm_stats *stats);
+int zpool_stats(struct zpool_stats *stats);
+int rsslimit(int limit, struct rss_usage *usage);
+
+#define PAGE                4096
+#define VMB_PAGES           128             /* Pages of the fault and sweep tests, twice the TLB */
+#define VMB_SWEEPS          16              /* Passes of the TLB sweep */
+#define VMB_SPARSE_TOUCHES  64
+#define VMB_SPARSE_STRIDE   (64 * PAGE)     /* One page per third level page table */
+#define VMB_CHURN           8               /* exec/exit pairs per run */
+#define VMB_STACK_DEPTH     40              /* Frames of VMB_FRAME_BYTES */
+#define VMB_FRAME_BYTES     1024
+#define VMB_KSM_CHILDREN    4
+#define VMB_KSM_PAGES       32              /* Identical pages in each child */
+#define VMB_KSM_WAIT        12              /* Seconds, two scans */
+#define VMB_ZPOOL_PAGES     1024            /* Compressible pages, meant to exceed RAM */
+#define VMB_COLOUR_PAGES    4               /* One page of each colour */
+#define VMB_COLOUR_PASSES   256
+#define VMB_QUIET_PAGES     32              /* Working set of the well-behaved tenant */
+#define VMB_QUIET_PASSES    64
+#define VMB_HOG_LIMIT       64              /* Pages the hog may keep resident */
+#define VMB_HOG_SECONDS     10              /* Outlasts the tenant's runs */
+
+static char region[VMB_PAGES * PAGE] __attribute__((aligned(PAGE)));
+static char sparse[VMB_SPARSE_TOUCHES * VMB_SPARSE_STRIDE] __attribute__((aligned(PAGE)));
+static char ksm_area[VMB_KSM_PAGES * PAGE] __attribute__((aligned(PAGE)));
+static char zpool_area[VMB_ZPOOL_PAGES * PAGE] __attribute__((aligned(PAGE)));
+static char quiet_area[VMB_QUIET_PAGES * PAGE] __attribute__((aligned(PAGE)));
+static unsigned colour_area[VMB_COLOUR_PAGES * PAGE / sizeof(unsigned)] __attribute__((aligned(PAGE)));
+
+static unsigned order[VMB_PAGES];           /* Random page order of touch_rand */
+static volatile unsigned sink;              /* Keeps reads from being optimised away */
+
+// Give the frames of the area back, its next touch faults again
+static void release(void *area, size_t len) {
+    if (madvise(area, len, MADV_DONTNEED) < 0) err(1, "madvise");
+}
+
+static void touch_all(char *area, unsigned pages) {
+    for (unsigned p = 0; p < pages; p++) area[p * PAGE] = 1;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                   fault paths                      //
+////////////////////////////////////////////////////////
+
+static uint64_t touch_seq(void *arg) {
+    (void)arg;
+    release(region, sizeof(region));
+
+    uint64_t start = bench_now();
+    touch_all(region, VMB_PAGES);
+    return bench_now() - start;
+}
+
+static uint64_t touch_rand(void *arg) {
+    (void)arg;
+    release(region, sizeof(region));
+
+    uint64_t start = bench_now();
+    for (unsigned i = 0; i < VMB_PAGES; i++) region[order[i] * PAGE] = 1;
+    return bench_now() - start;
+}
+
+// Resident pages read in turn, each access misses the TLB
+static uint64_t tlb_sweep(void *arg) {
+    (void)arg;
+    touch_all(region, VMB_PAGES);
+
+    unsigned sum = 0;
+    uint64_t start = bench_now();
+    for (unsigned s = 0; s < VMB_SWEEPS; s++) {
+        for (unsigned p = 0; p < VMB_PAGES; p++) sum += region[p * PAGE];
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    sink = sum;
+    return elapsed;
+}
+
+static uint64_t sparse_touch(void *arg) {
+    (void)arg;
+    release(sparse, sizeof(sparse));
+
+    uint64_t start = bench_now();
+    for (unsigned i = 0; i < VMB_SPARSE_TOUCHES; i++) sparse[i * VMB_SPARSE_STRIDE] = 1;
+    return bench_now() - start;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                 fork, exec, exit                   //
+////////////////////////////////////////////////////////
+
+static void wait_child(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) < 0) err(1, "waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) errx(1, "child %d failed", pid);
+}
+
+// fork and wait for a child that exits at once, as_copy and as_destroy of VMB_PAGES pages
+static uint64_t fork_rss(void *arg) {
+    (void)arg;
+    touch_all(region, VMB_PAGES);
+
+    uint64_t start = bench_now();
+    pid_t pid = fork();
+    if (pid < 0) err(1, "fork");
+    if (pid == 0) _exit(0);
+    wait_child(pid);
+    return bench_now() - start;
+}
+
+static uint64_t exec_churn(void *arg) {
+    (void)arg;
+    char *args[] = { (char *)"true", NULL };
+
+    uint64_t start = bench_now();
+    for (int i = 0; i < VMB_CHURN; i++) {
+        pid_t pid = fork();
+        if (pid < 0) err(1, "fork");
+        if (pid == 0) {
+            execv("/bin/true", args);
+            _exit(1);
+        }
+        wait_child(pid);
+    }
+    return bench_now() - start;
+}
+
+static unsigned recurse(unsigned depth) {
+    volatile char frame[VMB_FRAME_BYTES];
+    frame[0] = depth;
+    frame[VMB_FRAME_BYTES - 1] = depth;
+    return depth == 0 ? frame[0] : recurse(depth - 1) + frame[VMB_FRAME_BYTES - 1];
+}
+
+// Stack growth in a fresh child, whose deep stack pages are not resident yet
+static void stack_depth(void) {
+    uint64_t samples[BENCH_MAX_RUNS];
+
+    for (unsigned i = 0; i < bench_runs(); i++) {
+        int fds[2];
+        if (pipe(fds) < 0) err(1, "pipe");
+
+        pid_t pid = fork();
+        if (pid < 0) err(1, "fork");
+        if (pid == 0) {
+            uint64_t start = bench_now();
+            sink = recurse(VMB_STACK_DEPTH);
+            uint64_t elapsed = bench_now() - start;
+            _exit(write(fds[1], &elapsed, sizeof(elapsed)) == sizeof(elapsed) ? 0 : 1);
+        }
+
+        if (read(fds[0], &samples[i], sizeof(samples[i])) != sizeof(samples[i])) errx(1, "stack_depth: no result");
+        close(fds[0]);
+        close(fds[1]);
+        wait_child(pid);
+    }
+
+    bench_record("stack_depth", VMB_STACK_DEPTH, samples, bench_runs());
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//             merging, compression, colour           //
+////////////////////////////////////////////////////////
+
+// Children with identical pages idle across two scans, report what merging got back
+static void ksm_fleet(void) {
+    int ready[2], done[2];
+    pid_t pids[VMB_KSM_CHILDREN];
+
+    if (pipe(ready) < 0 || pipe(done) < 0) err(1, "pipe");
+
+    for (int i = 0; i < VMB_KSM_CHILDREN; i++) {
+        if ((pids[i] = fork()) < 0) err(1, "fork");
+        if (pids[i] == 0) {
+            close(done[1]);
+            for (unsigned p = 0; p < VMB_KSM_PAGES; p++) memset(&ksm_area[p * PAGE], 0x5a, PAGE);
+
+            char c = 0;
+            write(ready[1], &c, 1);
+            read(done[0], &c, 1);      // Returns at EOF once the parent is done
+            _exit(0);
+        }
+    }
+
+    for (int i = 0; i < VMB_KSM_CHILDREN; i++) {
+        char c;
+        if (read(ready[0], &c, 1) != 1) errx(1, "ksm_fleet: child did not start");
+    }
+
+    struct ksm_stats before, after;
+    if (ksm_stats(&before) < 0) err(1, "ksm_stats");
+    uint64_t until = bench_now() + (uint64_t)VMB_KSM_WAIT * 1000000000;
+    while (bench_now() < until) continue;
+    if (ksm_stats(&after) < 0) err(1, "ksm_stats");
+
+    close(done[1]);
+    for (int i = 0; i < VMB_KSM_CHILDREN; i++) wait_child(pids[i]);
+    close(done[0]);
+    close(ready[0]);
+    close(ready[1]);
+
+    uint64_t passes = after.passes - before.passes;
+    bench_metric("ksm_frames_reclaimed", after.pages_merged - before.pages_merged, "frames");
+    bench_metric("ksm_scan_ns_per_pass", passes ? (after.scan_ns - before.scan_ns) / passes : 0, "ns");
+}
+
+// Fill more compressible pages than fit in RAM and read them back
+static void zpool_pressure(void) {
+    struct zpool_stats before, after;
+    if (zpool_stats(&before) < 0) err(1, "zpool_stats");
+
+    for (unsigned p = 0; p < VMB_ZPOOL_PAGES; p++) {
+        memset(&zpool_area[p * PAGE], 0, PAGE);
+        *(unsigned *)&zpool_area[p * PAGE] = p;
+    }
+
+    unsigned sum = 0;
+    uint64_t start = bench_now();
+    for (unsigned p = 0; p < VMB_ZPOOL_PAGES; p++) sum += *(unsigned *)&zpool_area[p * PAGE];
+    uint64_t elapsed = bench_now() - start;
+    sink = sum;
+
+    if (zpool_stats(&after) < 0) err(1, "zpool_stats");
+    release(zpool_area, sizeof(zpool_area));
+
+    uint64_t faults = after.decompressed - before.decompressed;
+    bench_metric("zpool_reread_ns_per_page", elapsed / VMB_ZPOOL_PAGES, "ns");
+    bench_metric("zpool_pages_compressed", after.compressed - before.compressed, "pages");
+    bench_metric("zpool_ratio_x100", after.stored_bytes ? (uint64_t)after.stored_pages * PAGE * 100 / after.stored_bytes : 0, "ratio");
+    bench_metric("zpool_decompress_ns", faults ? (after.decompress_ns - before.decompress_ns) / faults : 0, "ns");
+}
+
+// Stream over one page of every colour, which only fits the cache if the frames do not collide
+static uint64_t colour_stream(void *arg) {
+    (void)arg;
+    const unsigned words = sizeof(colour_area) / sizeof(unsigned);
+    release(colour_area, sizeof(colour_area));
+    for (unsigned w = 0; w < words; w++) colour_area[w] = w;
+
+    unsigned sum = 0;
+    uint64_t start = bench_now();
+    for (unsigned pass = 0; pass < VMB_COLOUR_PASSES; pass++) {
+        for (unsigned w = 0; w < words; w++) sum += colour_area[w];
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    sink = sum;
+    return elapsed;
+}
+
+// NOTE:
+////////////////////////////////////////////////////////
+//                  multi-tenant                      //
+////////////////////////////////////////////////////////
+
+// The well-behaved tenant writes over its small working set
+static uint64_t tenant_quiet(void *arg) {
+    (void)arg;
+    touch_all(quiet_area, VMB_QUIET_PAGES);
+
+    uint64_t start = bench_now();
+    for (unsigned pass = 0; pass < VMB_QUIET_PASSES; pass++) {
+        for (unsigned p = 0; p < VMB_QUIET_PAGES; p++) quiet_area[p * PAGE] = pass;
+    }
+    return bench_now() - start;
+}
+
+/* Time the tenant next to a child that keeps writing more pages than
+ * its RSS limit allows. The hog has to trim its own pages, so the times
+ * should stay close to tenant_alone.
+ */
+static void tenant_with_hog(void) {
+    int fds[2];
+    if (pipe(fds) < 0) err(1, "pipe");
+
+    pid_t pid = fork();
+    if (pid < 0) err(1, "fork");
+    if (pid == 0) {
+        if (rsslimit(VMB_HOG_LIMIT, NULL) < 0) _exit(1);
+
+        uint64_t until = bench_now() + (uint64_t)VMB_HOG_SECONDS * 1000000000;
+        for (unsigned pass = 0; bench_now() < until; pass++) {
+            for (unsigned p = 0; p < VMB_ZPOOL_PAGES; p++) *(unsigned *)&zpool_area[p * PAGE] = pass + p;
+        }
+
+        struct rss_usage usage;
+        if (rsslimit(RSS_UNCHANGED, &usage) < 0) _exit(1);
+        _exit(write(fds[1], &usage, sizeof(usage)) == sizeof(usage) ? 0 : 1);
+    }
+
+    bench_run("tenant_with_hog", VMB_QUIET_PAGES * VMB_QUIET_PASSES, tenant_quiet, NULL);
+
+    struct rss_usage usage;
+    if (read(fds[0], &usage, sizeof(usage)) != sizeof(usage)) errx(1, "tenant: no result from the hog");
+    close(fds[0]);
+    close(fds[1]);
+    wait_child(pid);
+
+    bench_metric("tenant_hog_rss", usage.rss, "pages");
+    bench_metric("tenant_hog_trimmed", usage.trimmed, "pages");
+    bench_metric("tenant_hog_compressed", usage.compressed, "pages");
+    bench_metric("tenant_hog_overruns", usage.overruns, "faults");
+}
+
+int main(int argc, char **argv) {
+    bench_init("vmbench", argc, argv);
+
+    // Fixed shuffle so runs are comparable
+    srandom(1);
+    for (unsigned i = 0; i < VMB_PAGES; i++) order[i] = i;
+    for (unsigned i = VMB_PAGES - 1; i > 0; i--) {
+        unsigned j = random() % (i + 1);
+        unsigned t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    bench_run("touch_seq", VMB_PAGES, touch_seq, NULL);
+    bench_run("touch_rand", VMB_PAGES, touch_rand, NULL);
+    bench_run("tlb_sweep", VMB_PAGES * VMB_SWEEPS, tlb_sweep, NULL);
+    bench_run("sparse_touch", VMB_SPARSE_TOUCHES, sparse_touch, NULL);
+    bench_run("fork_rss", 1, fork_rss, NULL);
+    release(region, sizeof(region));
+    bench_run("exec_churn", VMB_CHURN, exec_churn, NULL);
+    if (bench_selected("stack_depth")) stack_depth();
+    bench_run("colour_stream", VMB_COLOUR_PASSES * sizeof(colour_area) / sizeof(unsigned), colour_stream, NULL);
+    if (bench_selected("ksm_fleet")) ksm_fleet();
+    if (bench_selected("zpool_pressure")) zpool_pressure();
+    bench_run("tenant_alone", VMB_QUIET_PAGES * VMB_QUIET_PASSES, tenant_quiet, NULL);
+    if (bench_selected("tenant_with_hog")) tenant_with_hog();
+
+    return bench_finish();
+}